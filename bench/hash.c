@@ -0,0 +1,79 @@
+// Compares the string hash in hash.h with the FNV-1a it replaced, on short
+// identifiers and on long strings. Build from the repository root with
+//   gcc -O2 -std=c99 bench/hash.c -o hashbench
+#include "../hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static uint32_t fnv1a(const char *key, size_t length) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= key[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+// The way object.c calls it, with the seed known at compile time.
+static uint32_t seeded(const char *key, size_t length) {
+	return hashBytes(key, length, HASH_SEED);
+}
+
+typedef uint32_t (*HashFn)(const char *key, size_t length);
+
+static const char *identifiers[] = {
+	"x",		"i",		   "fib",	   "this",	   "init",
+	"print",	"Vector",	   "length",   "counter",  "position",
+	"velocity", "toString",	   "getField", "setField", "elementCount",
+	"callback", "accumulator", "slen",	   "str",	   "transitions"};
+#define IDENTIFIER_COUNT (sizeof(identifiers) / sizeof(identifiers[0]))
+
+static double seconds() { return (double)clock() / CLOCKS_PER_SEC; }
+
+// Keeps the hash calls from being optimized out.
+static volatile uint32_t sink;
+
+// Nanoseconds per call.
+static double run(HashFn hash, const char **keys, size_t *lengths, int count,
+				  long rounds) {
+	double start = seconds();
+	for (long r = 0; r < rounds; r++) {
+		for (int i = 0; i < count; i++)
+			sink += hash(keys[i], lengths[i]);
+	}
+	return (seconds() - start) * 1e9 / ((double)rounds * count);
+}
+
+static void compare(const char *name, const char **keys, size_t *lengths,
+					int count, long rounds) {
+	size_t bytes = 0;
+	for (int i = 0; i < count; i++)
+		bytes += lengths[i];
+	double fnv = run(fnv1a, keys, lengths, count, rounds);
+	double wy = run(seeded, keys, lengths, count, rounds);
+	double perKey = (double)bytes / count;
+	printf("%-12s fnv1a %9.2f ns (%5.2f GB/s)  hashBytes %9.2f ns (%5.2f "
+		   "GB/s)  %4.1fx\n",
+		   name, fnv, perKey / fnv, wy, perKey / wy, fnv / wy);
+}
+
+int main() {
+	size_t lengths[IDENTIFIER_COUNT];
+	for (size_t i = 0; i < IDENTIFIER_COUNT; i++)
+		lengths[i] = strlen(identifiers[i]);
+	compare("identifiers", identifiers, lengths, IDENTIFIER_COUNT, 2000000);
+
+	size_t sizes[] = {64, 1024, 64 * 1024};
+	for (int s = 0; s < 3; s++) {
+		char *payload = malloc(sizes[s]);
+		for (size_t i = 0; i < sizes[s]; i++)
+			payload[i] = (char)(' ' + (i * 7 + i / 13) % 95);
+		const char *keys[] = {payload};
+		char name[16];
+		snprintf(name, sizeof(name), "%zu bytes", sizes[s]);
+		compare(name, keys, &sizes[s], 1, 64 * 1024 * 1024 / sizes[s] + 1000);
+		free(payload);
+	}
+	return 0;
+}
\ No newline at end of file
@@ -8,28 +8,51 @@ void initChunk(Chunk *c) {
 	c->count = 0;
 	c->capacity = 0;
 	c->code = NULL;
+	c->lineCount = 0;
+	c->lineCapacity = 0;
 	c->lines = NULL;
+	c->cacheCount = 0;
+	c->cacheCapacity = 0;
+	c->caches = NULL;
 	initValueArray(&(c->constants));
 }
 
+static void addLine(Chunk *chunk, int line) {
+	// The compiler may have rewound count over code it already wrote.
+	while (chunk->lineCount > 0 &&
+		   chunk->lines[chunk->lineCount - 1].offset >= chunk->count)
+		chunk->lineCount--;
+	if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line)
+		return;
+
+	if (chunk->lineCapacity < chunk->lineCount + 1) {
+		int oldCapacity = chunk->lineCapacity;
+		chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->lines = GROW_ARRAY(chunk->lines, LineStart, oldCapacity,
+								  chunk->lineCapacity);
+	}
+	LineStart *start = &chunk->lines[chunk->lineCount++];
+	start->offset = chunk->count;
+	start->line = line;
+}
+
 void writeChunk(Chunk *chunk, uint8_t byte, int line) {
 	if (chunk->capacity < chunk->count + 1) {
 		int oldCapacity = chunk->capacity;
 		chunk->capacity = GROW_CAPACITY(oldCapacity);
 		chunk->code =
 			GROW_ARRAY(chunk->code, uint8_t, oldCapacity, chunk->capacity);
-		chunk->lines =
-			GROW_ARRAY(chunk->lines, int, oldCapacity, chunk->capacity);
 	}
 
 	chunk->code[chunk->count] = byte;
-	chunk->lines[chunk->count] = line;
+	addLine(chunk, line);
 	(chunk->count)++;
 }
 
 void freeChunk(Chunk *chunk) {
 	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	FREE_ARRAY(int, chunk->lines, chunk->capacity);
+	FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+	FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
 
 	freeValueArray(&(chunk->constants));
 	initChunk(chunk);
@@ -40,4 +63,201 @@ int addConstant(Chunk *chunk, Value value) {
 	writeValueArray(&(chunk->constants), value);
 	pop();
 	return chunk->constants.count - 1;
+}
+
+int addInlineCache(Chunk *chunk) {
+	if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+		int oldCapacity = chunk->cacheCapacity;
+		chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->caches = GROW_ARRAY(chunk->caches, InlineCache, oldCapacity,
+								   chunk->cacheCapacity);
+	}
+	chunk->caches[chunk->cacheCount].count = 0;
+	return chunk->cacheCount++;
+}
+
+// Binary searches for the last run starting at or before offset.
+int getLine(Chunk *chunk, int offset) {
+	int low = 0;
+	int high = chunk->lineCount - 1;
+	while (low < high) {
+		int mid = low + (high - low + 1) / 2;
+		if (chunk->lines[mid].offset > offset)
+			high = mid - 1;
+		else
+			low = mid;
+	}
+	return chunk->lines[low].line;
+}
+
+// Size in bytes of the instruction at offset, operands included.
+int instructionLength(Chunk *chunk, int offset) {
+	switch (chunk->code[offset]) {
+	case OP_CONSTANT:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_POPN:
+	case OP_CALL:
+	case OP_TAIL_CALL:
+	case OP_SET_UPV:
+	case OP_GET_UPV:
+		return 2;
+	case OP_DEFINE_GLOBAL:
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP:
+	case OP_LOOP:
+	case OP_GET_LOCAL_LOCAL:
+	case OP_ADD_LOCAL_CONST:
+	case OP_LESS_JUMP_IF_FALSE:
+	case OP_LESS_EQUAL_JUMP_IF_FALSE:
+	case OP_GREATER_JUMP_IF_FALSE:
+	case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+	case OP_POP_LOOP:
+		return 3;
+	case OP_CONSTANT_LONG:
+	case OP_CLASS:
+	case OP_METHOD:
+		return 4;
+	case OP_GET_FIELD:
+	case OP_SET_FIELD:
+	case OP_GET_THIS_FIELD:
+		return 6;
+	case OP_INVOKE:
+	case OP_TAIL_INVOKE:
+		return 7;
+	case OP_CLOSURE: {
+		uint8_t *operand = &chunk->code[offset + 1];
+		int constant = (operand[0] << 16) | (operand[1] << 8) | operand[2];
+		Value func = chunk->constants.values[constant];
+		return 4 + 2 * AS_FUNCTION(func)->upvalueCount;
+	}
+	default:
+		return 1;
+	}
+}
+
+// How many values an instruction leaves minus how many it takes. Temporaries
+// pushed while running it are covered by STACK_RESERVE.
+static int stackEffect(Chunk *chunk, int offset) {
+	uint8_t *code = &chunk->code[offset];
+	switch (code[0]) {
+	case OP_CONSTANT:
+	case OP_CONSTANT_LONG:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_NULL:
+	case OP_GET_GLOBAL:
+	case OP_GET_LOCAL:
+	case OP_GET_UPV:
+	case OP_CLOSURE:
+	case OP_CLASS:
+	case OP_ADD_LOCAL_CONST:
+	case OP_GET_THIS_FIELD:
+		return 1;
+	case OP_GET_LOCAL_LOCAL:
+		return 2;
+	case OP_POPN:
+	case OP_CALL:
+	case OP_TAIL_CALL:
+		return -code[1];
+	case OP_INVOKE:
+	case OP_TAIL_INVOKE:
+		return -code[4];
+	case OP_LESS_JUMP_IF_FALSE:
+	case OP_LESS_EQUAL_JUMP_IF_FALSE:
+	case OP_GREATER_JUMP_IF_FALSE:
+	case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+		return -2;
+	case OP_ADD:
+	case OP_SUB:
+	case OP_MUL:
+	case OP_DIV:
+	case OP_EQUALS:
+	case OP_NOT_EQUALS:
+	case OP_LESS:
+	case OP_LESS_EQUAL:
+	case OP_GREATER:
+	case OP_GREATER_EQUAL:
+	case OP_MODULO:
+	case OP_INT_DIV:
+	case OP_BIT_AND:
+	case OP_BIT_OR:
+	case OP_BIT_XOR:
+	case OP_SHIFT_LEFT:
+	case OP_SHIFT_RIGHT:
+	case OP_ADD_NUM:
+	case OP_ADD_STR:
+	case OP_SUB_NUM:
+	case OP_MUL_NUM:
+	case OP_DIV_NUM:
+	case OP_LESS_NUM:
+	case OP_LESS_EQUAL_NUM:
+	case OP_GREATER_NUM:
+	case OP_GREATER_EQUAL_NUM:
+	case OP_ADD_INT:
+	case OP_SUB_INT:
+	case OP_MUL_INT:
+	case OP_LESS_INT:
+	case OP_LESS_EQUAL_INT:
+	case OP_GREATER_INT:
+	case OP_GREATER_EQUAL_INT:
+	case OP_PRINT:
+	case OP_POP:
+	case OP_DEFINE_GLOBAL:
+	case OP_CLOSE_UPV:
+	case OP_MAP:
+	case OP_SET_FIELD:
+	case OP_METHOD:
+	case OP_POP_LOOP:
+		return -1;
+	default:
+		return 0;
+	}
+}
+
+// Deepest the stack gets while running chunk, starting from base values.
+// Where paths join, the deeper one wins, so the result never falls short.
+int maxStackDepth(Chunk *chunk, int base) {
+	int *depthAt = malloc(sizeof(int) * chunk->count);
+	for (int i = 0; i < chunk->count; i++)
+		depthAt[i] = -1;
+
+	int depth = base;
+	int max = base;
+	bool fallsThrough = true;
+	for (int offset = 0; offset < chunk->count;
+		 offset += instructionLength(chunk, offset)) {
+		if (depthAt[offset] != -1 &&
+			(!fallsThrough || depthAt[offset] > depth))
+			depth = depthAt[offset];
+
+		uint8_t op = chunk->code[offset];
+		depth += stackEffect(chunk, offset);
+		if (depth > max)
+			max = depth;
+
+		fallsThrough = op != OP_JUMP && op != OP_LOOP && op != OP_POP_LOOP &&
+					   op != OP_RETURN && op != OP_TAIL_CALL &&
+					   op != OP_TAIL_INVOKE;
+		switch (op) {
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_LESS_JUMP_IF_FALSE:
+		case OP_LESS_EQUAL_JUMP_IF_FALSE:
+		case OP_GREATER_JUMP_IF_FALSE:
+		case OP_GREATER_EQUAL_JUMP_IF_FALSE: {
+			int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+			int target = offset + 3 + jump;
+			if (target < chunk->count && depthAt[target] < depth)
+				depthAt[target] = depth;
+			break;
+		}
+		default:;
+		}
+	}
+
+	free(depthAt);
+	return max;
 }
\ No newline at end of file
@@ -44,20 +44,103 @@ typedef enum {
 	OP_GET_FIELD,
 	OP_SET_FIELD,
 	OP_METHOD,
-	OP_INVOKE
+	OP_INVOKE,
+	OP_INT_DIV,
+	OP_BIT_AND,
+	OP_BIT_OR,
+	OP_BIT_XOR,
+	OP_BIT_NOT,
+	OP_SHIFT_LEFT,
+	OP_SHIFT_RIGHT,
+	OP_CONSTANT_LONG,
+	OP_TAIL_CALL,
+	OP_TAIL_INVOKE,
+
+	// Superinstructions, fused from common sequences by the optimizer.
+	OP_GET_LOCAL_LOCAL,
+	OP_ADD_LOCAL_CONST,
+	OP_GET_THIS_FIELD,
+	OP_LESS_JUMP_IF_FALSE,
+	OP_LESS_EQUAL_JUMP_IF_FALSE,
+	OP_GREATER_JUMP_IF_FALSE,
+	OP_GREATER_EQUAL_JUMP_IF_FALSE,
+	OP_POP_LOOP,
+
+	// Type-specialized forms. The compiler never emits these, run() patches
+	// them over the generic opcode once the operand types are known.
+	OP_ADD_NUM,
+	OP_ADD_STR,
+	OP_SUB_NUM,
+	OP_MUL_NUM,
+	OP_DIV_NUM,
+	OP_LESS_NUM,
+	OP_LESS_EQUAL_NUM,
+	OP_GREATER_NUM,
+	OP_GREATER_EQUAL_NUM,
+	OP_ADD_INT,
+	OP_SUB_INT,
+	OP_MUL_INT,
+	OP_LESS_INT,
+	OP_LESS_EQUAL_INT,
+	OP_GREATER_INT,
+	OP_GREATER_EQUAL_INT
 } OpCode;
 
+#define IC_ENTRIES 4
+
+// What a property access site resolved to for one receiver shape. slot is
+// the field's index in the instance's slots, or -1 for a method. For an
+// OP_SET_FIELD that adds the field, transition is the shape to move to.
+typedef struct {
+	ObjShape *shape;
+	ObjShape *transition;
+	int slot;
+	Value method;
+} CacheEntry;
+
+// Per-instruction inline cache of OP_GET_FIELD, OP_SET_FIELD and OP_INVOKE.
+// count goes past IC_ENTRIES once the site has seen too many shapes, after
+// which no new entries are recorded.
+typedef struct {
+	int count;
+	CacheEntry entries[IC_ENTRIES];
+} InlineCache;
+
+// How OP_CLOSURE captures each upvalue: sharing one of the enclosing
+// closure's, by reference to a local, or by copying a local that is never
+// reassigned into a cell in the closure.
+typedef enum {
+	CAPTURE_ENCLOSING,
+	CAPTURE_LOCAL,
+	CAPTURE_LOCAL_VALUE
+} CaptureKind;
+
+// Where a run of bytes compiled from the same line starts.
+typedef struct {
+	int offset;
+	int line;
+} LineStart;
+
 typedef struct {
 	int count;
 	int capacity;
 	uint8_t *code;
 	ValueArray constants;
-	int *lines;
+	int lineCount;
+	int lineCapacity;
+	LineStart *lines;
+	int cacheCount;
+	int cacheCapacity;
+	InlineCache *caches;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 void freeChunk(Chunk *chunk);
 int addConstant(Chunk *chunk, Value value);
+int addInlineCache(Chunk *chunk);
+int instructionLength(Chunk *chunk, int offset);
+int getLine(Chunk *chunk, int offset);
+int maxStackDepth(Chunk *chunk, int base);
 
 #endif
\ No newline at end of file
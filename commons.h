@@ -5,14 +5,33 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#define NAN_BOXING
+
+// Computed-goto dispatch in run(). Needs GCC/Clang labels-as-values, the
+// switch is used otherwise.
+#if defined(__GNUC__)
+#define THREADED_DISPATCH
+#endif
+
+// Probe table control bytes with SSE2 compares, a byte at a time otherwise.
+#if defined(__SSE2__)
+#define SIMD_TABLE
+#endif
+
+// Share long marking traces between threads. Needs pthreads (-pthread).
+// #define PARALLEL_MARK
+
 // #define DEBUG_TRACE_EXECUTION
   #define DEBUG_TRACE_BYTECODE
 // #define DEBUG_CLOCKS
 // #define DEBUG_STRESSGC
 // #define DEBUG_LOGGC
 // #define DEBUG_EXPOSEGC
+// #define DEBUG_CACHE_STATS
+// #define DEBUG_GC_PAUSES
 
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT24_MAX 0xffffff
 
 #endif
\ No newline at end of file
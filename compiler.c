@@ -3,7 +3,10 @@
 #include "dbg.h"
 #include "mem.h"
 #include "object.h"
+#include "optimizer.h"
 #include "value.h"
+#include "vm.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,9 +25,13 @@ typedef enum {
 	PREC_AND,		 // and
 	PREC_EQUALITY,	 // == !=
 	PREC_COMPARISON, // < > <= >=
+	PREC_BIT_OR,	 // |
+	PREC_BIT_XOR,	 // ^
+	PREC_BIT_AND,	 // &
+	PREC_SHIFT,		 // << >>
 	PREC_TERM,		 // + -
-	PREC_FACTOR,	 // *
-	PREC_UNARY,		 // ! -
+	PREC_FACTOR,	 // * / \ %
+	PREC_UNARY,		 // ! - ~
 	PREC_CALL,		 // . ()
 	PREC_PRIMARY
 } Precedence;
@@ -41,8 +48,22 @@ typedef struct {
 	Token name;
 	int depth;
 	bool isCaptured;
+	bool isAssigned;
 } Local;
 
+// The capture kind byte an OP_CLOSURE has for one of our locals.
+typedef struct {
+	int offset;
+	int local;
+} CaptureSite;
+
+// A const declaration. Uses are replaced by the value itself.
+typedef struct {
+	Token name;
+	int depth;
+	Value value;
+} Constant;
+
 typedef enum {
 	TYPE_FUNCTION,
 	TYPE_SCRIPT,
@@ -55,7 +76,7 @@ typedef struct {
 } Loop;
 
 typedef struct {
-	uint8_t *begin;
+	int begin;
 	int length;
 } ESReturn;
 
@@ -74,6 +95,27 @@ typedef struct Compiler {
 	int loopCount;
 	Loop loops[256];
 	Upvalue upvalues[UINT8_COUNT];
+	Constant constants[UINT8_COUNT];
+	int constantCount;
+	// Where the instruction pushing the last constant expression starts and
+	// ends, so that an operator applied to it can be folded.
+	int foldStart;
+	int foldEnd;
+	Value foldValue;
+	// Where the last OP_CALL or OP_INVOKE starts and ends, so a return right
+	// after it can become a tail call.
+	int callStart;
+	int callEnd;
+	// Pool index of each constant keyed on its identity, -1 for empty slots,
+	// and how many instructions refer to each pool entry.
+	int *constantSlots;
+	int *constantUses;
+	int constantCapacity;
+	// Captures of locals still in scope. Once a local goes out of scope and
+	// was never reassigned, its closures copy it instead.
+	CaptureSite *captures;
+	int captureCount;
+	int captureCapacity;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -85,6 +127,8 @@ Parser parser;
 Chunk *compilingChunk;
 Compiler *current = NULL;
 ClassCompiler *currentClass = NULL;
+// Start of the left operand of the infix rule being called.
+static int operandStart;
 
 #define check(x) (parser.current.type == x)
 
@@ -168,20 +212,125 @@ static void emitPop(uint8_t pops) {
 		emitBytes(OP_POPN, pops);
 }
 
-uint8_t makeConstant(Value val) {
-	int c = addConstant(currentChunk(), val);
-	if (c >= UINT8_MAX) {
-		error("Too many constants in one chunk");
-		return 0;
+static void emitLong(int operand) {
+	emitByte((operand >> 16) & 0xff);
+	emitBytes((operand >> 8) & 0xff, operand & 0xff);
+}
+
+static int *findConstantSlot(Value value) {
+	ValueArray *pool = &currentChunk()->constants;
+	int mask = current->constantCapacity - 1;
+	int *slot = &current->constantSlots[hashValue(value) & mask];
+	while (*slot != -1 && !identical(pool->values[*slot], value))
+		slot = &current->constantSlots[(slot - current->constantSlots + 1) &
+										mask];
+	return slot;
+}
+
+// Keeps the slots at most half full, with room for a use count per entry.
+static void growConstantSlots() {
+	int oldCapacity = current->constantCapacity;
+	int capacity = oldCapacity < 16 ? 16 : oldCapacity * 2;
+	FREE_ARRAY(int, current->constantSlots, oldCapacity);
+	current->constantSlots = ALLOCATE(int, capacity);
+	current->constantUses = GROW_ARRAY(current->constantUses, int,
+									   oldCapacity / 2, capacity / 2);
+	current->constantCapacity = capacity;
+	for (int i = 0; i < capacity; i++)
+		current->constantSlots[i] = -1;
+
+	// Entries go back in pool order, which dropConstant relies on.
+	ValueArray *pool = &currentChunk()->constants;
+	for (int i = 0; i < pool->count; i++)
+		*findConstantSlot(pool->values[i]) = i;
+}
+
+// Returns the pool index of value, adding it only if the chunk doesn't
+// already hold an identical constant.
+int makeConstant(Value val) {
+	if (currentChunk()->constants.count + 1 > current->constantCapacity / 2) {
+		// Growing can collect, and val may not be reachable yet.
+		push(val);
+		growConstantSlots();
+		pop();
 	}
-	return (uint8_t)c;
+	int *slot = findConstantSlot(val);
+	if (*slot == -1) {
+		int c = addConstant(currentChunk(), val);
+		writeBarrierValue(&current->function->obj, val);
+		if (c > UINT24_MAX) {
+			currentChunk()->constants.count--;
+			error("Too many constants in one chunk");
+			return 0;
+		}
+		*slot = c;
+		current->constantUses[c] = 0;
+	}
+	current->constantUses[*slot]++;
+	return *slot;
+}
+
+static void emitInlineCache() {
+	int cache = addInlineCache(currentChunk());
+	if (cache > UINT16_MAX)
+		error("Too many property accesses in one chunk");
+	emitBytes((cache >> 8) & 0xff, cache & 0xff);
 }
 
 static void emitConstant(Value value) {
-	emitBytes(OP_CONSTANT, makeConstant(value));
+	int start = currentChunk()->count;
+	if (IS_BOOL(value))
+		emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+	else if (IS_NULL(value))
+		emitByte(OP_NULL);
+	else {
+		int constant = makeConstant(value);
+		if (constant <= UINT8_MAX) {
+			emitBytes(OP_CONSTANT, constant);
+		} else {
+			emitByte(OP_CONSTANT_LONG);
+			emitLong(constant);
+		}
+	}
+	current->foldStart = start;
+	current->foldEnd = currentChunk()->count;
+	current->foldValue = value;
+}
+
+// Whether the code from start on is just a constant pushed by emitConstant.
+static bool foldable(int start, Value *value) {
+	if (current->foldStart != start ||
+		current->foldEnd != currentChunk()->count)
+		return false;
+	*value = current->foldValue;
+	return true;
+}
+
+// Called when the instruction at offset is being dropped. Its constant leaves
+// the pool if nothing else uses it and nothing was added after it.
+static void dropConstant(int offset) {
+	Chunk *chunk = currentChunk();
+	int constant;
+	if (chunk->code[offset] == OP_CONSTANT)
+		constant = chunk->code[offset + 1];
+	else if (chunk->code[offset] == OP_CONSTANT_LONG)
+		constant = (chunk->code[offset + 1] << 16) |
+				   (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+	else
+		return;
+
+	if (--current->constantUses[constant] == 0 &&
+		constant == chunk->constants.count - 1) {
+		// The most recent entry never lies on another one's probe sequence.
+		*findConstantSlot(chunk->constants.values[constant]) = -1;
+		chunk->constants.count--;
+	}
 }
 
 static void patchJump(int offset) {
+	// A jump landing here could skip over a constant before it.
+	current->foldEnd = -1;
+
 	int jump = currentChunk()->count - offset - 2;
 	if (jump > UINT16_MAX)
 		error("Too many lines to jump over");
@@ -189,6 +338,32 @@ static void patchJump(int offset) {
 	currentChunk()->code[offset + 1] = jump & 0xff;
 }
 
+static void addCaptureSite(int offset, int local) {
+	if (current->captureCapacity < current->captureCount + 1) {
+		int oldCapacity = current->captureCapacity;
+		current->captureCapacity = GROW_CAPACITY(oldCapacity);
+		current->captures = GROW_ARRAY(current->captures, CaptureSite,
+									   oldCapacity, current->captureCapacity);
+	}
+	CaptureSite *site = &current->captures[current->captureCount++];
+	site->offset = offset;
+	site->local = local;
+}
+
+// Locals from first on are going out of scope, so no assignment to them can
+// follow. Closures capturing one that was never reassigned copy it.
+static void settleCaptures(int first) {
+	int kept = 0;
+	for (int i = 0; i < current->captureCount; i++) {
+		CaptureSite *site = &current->captures[i];
+		if (site->local < first)
+			current->captures[kept++] = *site;
+		else if (!current->locals[site->local].isAssigned)
+			currentChunk()->code[site->offset] = CAPTURE_LOCAL_VALUE;
+	}
+	current->captureCount = kept;
+}
+
 static void initCompiler(Compiler *compiler, FunctionType type) {
 	compiler->parent = current;
 	compiler->function = NULL;
@@ -196,17 +371,30 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
 	compiler->localCount = 0;
 	compiler->scopeDepth = 0;
 	compiler->loopCount = 0;
+	compiler->constantCount = 0;
+	compiler->foldStart = -1;
+	compiler->foldEnd = -1;
+	compiler->callStart = -1;
+	compiler->callEnd = -1;
+	compiler->constantSlots = NULL;
+	compiler->constantUses = NULL;
+	compiler->constantCapacity = 0;
+	compiler->captures = NULL;
+	compiler->captureCount = 0;
+	compiler->captureCapacity = 0;
 	compiler->function = newFunction();
 	current = compiler;
 
 	if (type != TYPE_SCRIPT) {
 		current->function->name =
 			copyString(parser.previous.start, parser.previous.length);
+		writeBarrier(&current->function->obj, &current->function->name->obj);
 	}
 
 	Local *local = &current->locals[current->localCount++];
 	local->depth = 0;
 	local->isCaptured = false;
+	local->isAssigned = false;
 	if (type != TYPE_FUNCTION) {
 		local->name.start = "this";
 		local->name.length = 4;
@@ -219,6 +407,13 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
 static ObjFunction *endCompiler() {
 	emitReturn();
 	ObjFunction *func = current->function;
+	FREE_ARRAY(int, current->constantSlots, current->constantCapacity);
+	FREE_ARRAY(int, current->constantUses, current->constantCapacity / 2);
+	settleCaptures(0);
+	FREE_ARRAY(CaptureSite, current->captures, current->captureCapacity);
+	if (optimizeBytecode && !parser.hadError)
+		optimizeChunk(currentChunk());
+	func->maxStack = maxStackDepth(currentChunk(), func->arity + 1);
 #ifdef DEBUG_TRACE_BYTECODE
 	if (!parser.hadError)
 		disassembleChunk(currentChunk(), current->function->name != NULL
@@ -234,12 +429,20 @@ static void beginScope() { current->scopeDepth++; }
 static ESReturn endScope() {
 	current->scopeDepth--;
 	ESReturn e;
-	e.begin = current->function->chunk.code + current->function->chunk.count;
+	while (current->constantCount > 0 &&
+		   current->constants[current->constantCount - 1].depth >
+			   current->scopeDepth)
+		current->constantCount--;
+	int first = current->localCount;
+	while (first > 0 && current->locals[first - 1].depth > current->scopeDepth)
+		first--;
+	settleCaptures(first);
+
+	e.begin = currentChunk()->count;
 	uint8_t pops = 0;
-	while (current->localCount > 0 &&
-		   current->locals[current->localCount - 1].depth >
-			   current->scopeDepth) {
-		if (!current->locals[current->localCount - 1].isCaptured)
+	while (current->localCount > first) {
+		Local *local = &current->locals[current->localCount - 1];
+		if (!local->isCaptured || !local->isAssigned)
 			pops++;
 		else {
 			emitPop(pops);
@@ -249,8 +452,7 @@ static ESReturn endScope() {
 		current->localCount--;
 	}
 	emitPop(pops);
-	e.length = &current->function->chunk.code[current->function->chunk.count] -
-			   e.begin;
+	e.length = currentChunk()->count - e.begin;
 	return e;
 }
 
@@ -263,6 +465,7 @@ static void printStatement();
 static void expressionStatement();
 static void synchronize();
 static void varDeclaration();
+static void constDeclaration();
 static void ifStatement();
 static void whileStatement();
 static void forStatement();
@@ -271,65 +474,211 @@ static void funcDeclaration();
 static void returnStatement();
 static void classDeclaration();
 
-static uint8_t identifierConstant(Token *token);
+static int identifierConstant(Token *token);
+static int identifierGlobal(Token *token);
 
 static ParseRule *getRule(TokenType type);
 static void parsePrecedence(Precedence p);
 
+// Evaluates an operator on constant operands the way run() would. Anything
+// that would be a runtime error is left for run() to report.
+static bool foldBinary(OpCode op, Value a, Value b, Value *out) {
+	if (op == OP_EQUALS || op == OP_NOT_EQUALS) {
+		*out = BOOL_VALUE(equal(a, b) == (op == OP_EQUALS));
+		return true;
+	}
+	if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+		ObjString *str1 = AS_STRING(a);
+		ObjString *str2 = AS_STRING(b);
+		ObjString *str = newStringBuffer(str1->length + str2->length);
+		memcpy(str->chars, str1->chars, str1->length);
+		memcpy(str->chars + str1->length, str2->chars, str2->length);
+		*out = OBJ_VALUE((Obj *)takeString(str));
+		return true;
+	}
+	if (!IS_NUM(a) || !IS_NUM(b))
+		return false;
+
+	bool ints = IS_INT(a) && IS_INT(b);
+	switch (op) {
+	case OP_ADD:
+		*out = ints ? intAdd(AS_INT(a), AS_INT(b))
+					: NUM_VALUE(AS_NUM(a) + AS_NUM(b));
+		return true;
+	case OP_SUB:
+		*out = ints ? intSub(AS_INT(a), AS_INT(b))
+					: NUM_VALUE(AS_NUM(a) - AS_NUM(b));
+		return true;
+	case OP_MUL:
+		*out = ints ? intMul(AS_INT(a), AS_INT(b))
+					: NUM_VALUE(AS_NUM(a) * AS_NUM(b));
+		return true;
+	case OP_DIV:
+		*out = NUM_VALUE(AS_NUM(a) / AS_NUM(b));
+		return true;
+	case OP_LESS:
+		*out = BOOL_VALUE(ints ? AS_INT(a) < AS_INT(b) : AS_NUM(a) < AS_NUM(b));
+		return true;
+	case OP_LESS_EQUAL:
+		*out =
+			BOOL_VALUE(ints ? AS_INT(a) <= AS_INT(b) : AS_NUM(a) <= AS_NUM(b));
+		return true;
+	case OP_GREATER:
+		*out = BOOL_VALUE(ints ? AS_INT(a) > AS_INT(b) : AS_NUM(a) > AS_NUM(b));
+		return true;
+	case OP_GREATER_EQUAL:
+		*out =
+			BOOL_VALUE(ints ? AS_INT(a) >= AS_INT(b) : AS_NUM(a) >= AS_NUM(b));
+		return true;
+	default:;
+	}
+
+	int64_t x, y;
+	if (!toInteger(a, &x) || !toInteger(b, &y))
+		return false;
+	switch (op) {
+	case OP_MODULO:
+		if (y < 1 || x < 0)
+			return false;
+		*out = intValue(x % y);
+		return true;
+	case OP_INT_DIV:
+		if (y == 0 || (x == INT64_MIN && y == -1))
+			return false;
+		*out = intValue(x / y);
+		return true;
+	case OP_BIT_AND:
+		*out = intValue(x & y);
+		return true;
+	case OP_BIT_OR:
+		*out = intValue(x | y);
+		return true;
+	case OP_BIT_XOR:
+		*out = intValue(x ^ y);
+		return true;
+	case OP_SHIFT_LEFT:
+	case OP_SHIFT_RIGHT:
+		if (y < 0 || y > 63)
+			return false;
+		*out = op == OP_SHIFT_LEFT ? intShiftLeft(x, y) : intValue(x >> y);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool foldUnary(OpCode op, Value a, Value *out) {
+	int64_t x;
+	switch (op) {
+	case OP_NOT:
+		*out = BOOL_VALUE(!isTruthy(a));
+		return true;
+	case OP_NEGATE:
+		if (IS_INT(a))
+			*out = intSub(0, AS_INT(a));
+		else if (IS_DOUBLE(a))
+			*out = NUM_VALUE(-AS_DOUBLE(a));
+		else
+			return false;
+		return true;
+	case OP_BIT_NOT:
+		if (!toInteger(a, &x))
+			return false;
+		*out = intValue(~x);
+		return true;
+	default:
+		return false;
+	}
+}
+
 static void binary(bool canAssign) {
 	TokenType operator= parser.previous.type;
 	ParseRule *rule = getRule(operator);
+	int leftStart = operandStart;
+	int rightStart = currentChunk()->count;
+	Value left, right, result;
+	bool leftConstant = foldable(leftStart, &left);
 	parsePrecedence((int)rule->precedence + 1);
 
+	OpCode op;
 	switch (operator) {
 	case TOKEN_PLUS:
-		emitByte(OP_ADD);
+		op = OP_ADD;
 		break;
 	case TOKEN_MINUS:
-		emitByte(OP_SUB);
+		op = OP_SUB;
 		break;
 	case TOKEN_STAR:
-		emitByte(OP_MUL);
+		op = OP_MUL;
 		break;
 	case TOKEN_SLASH:
-		emitByte(OP_DIV);
+		op = OP_DIV;
 		break;
 	case TOKEN_LESS:
-		emitByte(OP_LESS);
+		op = OP_LESS;
 		break;
 	case TOKEN_GREATER:
-		emitByte(OP_GREATER);
+		op = OP_GREATER;
 		break;
 	case TOKEN_LESS_EQUAL:
-		emitByte(OP_LESS_EQUAL);
+		op = OP_LESS_EQUAL;
 		break;
 	case TOKEN_GREATER_EQUAL:
-		emitByte(OP_GREATER_EQUAL);
+		op = OP_GREATER_EQUAL;
 		break;
 	case TOKEN_EQUAL_EQUAL:
-		emitByte(OP_EQUALS);
+		op = OP_EQUALS;
 		break;
 	case TOKEN_BANG_EQUAL:
-		emitByte(OP_NOT_EQUALS);
+		op = OP_NOT_EQUALS;
 		break;
 	case TOKEN_MODULO: {
-		emitByte(OP_MODULO);
+		op = OP_MODULO;
 		break;
 	}
-	default:;
+	case TOKEN_BACKSLASH:
+		op = OP_INT_DIV;
+		break;
+	case TOKEN_AMPERSAND:
+		op = OP_BIT_AND;
+		break;
+	case TOKEN_PIPE:
+		op = OP_BIT_OR;
+		break;
+	case TOKEN_CARET:
+		op = OP_BIT_XOR;
+		break;
+	case TOKEN_LESS_LESS:
+		op = OP_SHIFT_LEFT;
+		break;
+	case TOKEN_GREATER_GREATER:
+		op = OP_SHIFT_RIGHT;
+		break;
+	default:
+		return;
 	}
+
+	if (leftConstant && foldable(rightStart, &right) &&
+		foldBinary(op, left, right, &result)) {
+		dropConstant(rightStart);
+		dropConstant(leftStart);
+		currentChunk()->count = leftStart;
+		emitConstant(result);
+		return;
+	}
+	emitByte(op);
 }
 
 static void literal(bool canAssign) {
 	switch (parser.previous.type) {
 	case TOKEN_NULL:
-		emitByte(OP_NULL);
+		emitConstant(NULL_VALUE);
 		return;
 	case TOKEN_FALSE:
-		emitByte(OP_FALSE);
+		emitConstant(BOOL_VALUE(false));
 		return;
 	case TOKEN_TRUE:
-		emitByte(OP_TRUE);
+		emitConstant(BOOL_VALUE(true));
 		return;
 	default:;
 	}
@@ -341,6 +690,15 @@ static void grouping(bool canAssign) {
 }
 
 static void number(bool canAssign) {
+	// Literals without a fraction are integers unless they are too big.
+	if (memchr(parser.previous.start, '.', parser.previous.length) == NULL) {
+		errno = 0;
+		long long value = strtoll(parser.previous.start, NULL, 10);
+		if (errno == 0 && INT_FITS(value)) {
+			emitConstant(INT_VALUE(value));
+			return;
+		}
+	}
 	double value = strtod(parser.previous.start, NULL);
 	emitConstant(NUM_VALUE(value));
 }
@@ -382,22 +740,32 @@ static uint8_t argumentList() {
 
 static void dot(bool canAssign) {
 	consume(TOKEN_IDENTIFIER, "Expected field name after '.'");
-	uint8_t name = identifierConstant(&parser.previous);
+	int name = identifierConstant(&parser.previous);
 	if (match(TOKEN_EQUAL) && canAssign) {
 		expression();
-		emitBytes(OP_SET_FIELD, name);
+		emitByte(OP_SET_FIELD);
+		emitLong(name);
+		emitInlineCache();
 	} else if (match(TOKEN_LEFT_PAREN)) {
 		uint8_t args = argumentList();
-		emitBytes(OP_INVOKE, name);
+		current->callStart = currentChunk()->count;
+		emitByte(OP_INVOKE);
+		emitLong(name);
 		emitByte(args);
+		emitInlineCache();
+		current->callEnd = currentChunk()->count;
 	} else {
-		emitBytes(OP_GET_FIELD, name);
+		emitByte(OP_GET_FIELD);
+		emitLong(name);
+		emitInlineCache();
 	}
 }
 
 static void call(bool canAssign) {
 	uint8_t argCount = argumentList();
+	current->callStart = currentChunk()->count;
 	emitBytes(OP_CALL, argCount);
+	current->callEnd = currentChunk()->count;
 }
 
 static bool identifiersEqual(Token *a, Token *b) {
@@ -454,7 +822,52 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
 	return -1;
 }
 
+// Looks for a const visible from compiler that isn't shadowed by a local.
+static bool resolveConstant(Compiler *compiler, Token *name, Value *value) {
+	for (Compiler *c = compiler; c != NULL; c = c->parent) {
+		int constantDepth = -1;
+		for (int i = c->constantCount - 1; i >= 0; i--) {
+			if (identifiersEqual(name, &c->constants[i].name)) {
+				constantDepth = c->constants[i].depth;
+				*value = c->constants[i].value;
+				break;
+			}
+		}
+		for (int i = c->localCount - 1; i >= 0; i--) {
+			Local *local = &c->locals[i];
+			if (identifiersEqual(name, &local->name)) {
+				if (local->depth == -1 || local->depth > constantDepth)
+					return false;
+				break;
+			}
+		}
+		if (constantDepth != -1)
+			return true;
+	}
+	return false;
+}
+
+// Flags the local an assignment through an upvalue ends up setting.
+static void markAssigned(Compiler *compiler, Token *name) {
+	for (Compiler *c = compiler; c != NULL; c = c->parent) {
+		for (int i = c->localCount - 1; i >= 0; i--) {
+			if (identifiersEqual(name, &c->locals[i].name)) {
+				c->locals[i].isAssigned = true;
+				return;
+			}
+		}
+	}
+}
+
 static void namedVariable(Token t, bool canAssign) {
+	Value constant;
+	if (resolveConstant(current, &t, &constant)) {
+		if (canAssign && check(TOKEN_EQUAL))
+			error("Cannot assign to a constant");
+		emitConstant(constant);
+		return;
+	}
+
 	uint8_t getOp, setOp;
 	int arg = resolveLocal(current, &t);
 	if (arg != -1) {
@@ -464,16 +877,25 @@ static void namedVariable(Token t, bool canAssign) {
 		getOp = OP_GET_UPV;
 		setOp = OP_SET_UPV;
 	} else {
-		arg = identifierConstant(&t);
+		arg = identifierGlobal(&t);
 		getOp = OP_GET_GLOBAL;
 		setOp = OP_SET_GLOBAL;
 	}
 
+	uint8_t op = getOp;
 	if (canAssign && match(TOKEN_EQUAL)) {
 		expression();
-		emitBytes(setOp, (uint8_t)arg);
+		op = setOp;
+		if (getOp == OP_GET_LOCAL)
+			current->locals[arg].isAssigned = true;
+		else if (getOp == OP_GET_UPV)
+			markAssigned(current->parent, &t);
+	}
+	if (getOp == OP_GET_GLOBAL) {
+		emitByte(op);
+		emitBytes((arg >> 8) & 0xff, arg & 0xff);
 	} else {
-		emitBytes(getOp, (uint8_t)arg);
+		emitBytes(op, (uint8_t)arg);
 	}
 }
 static void variable(bool canAssign) {
@@ -484,17 +906,32 @@ static void factorial(bool canAssign) { emitByte(OP_FACTORIAL); }
 
 static void unary(bool canAssign) {
 	TokenType operandType = parser.previous.type;
+	int start = currentChunk()->count;
 	parsePrecedence(PREC_UNARY);
+
+	OpCode op;
 	switch (operandType) {
 	case TOKEN_MINUS:
-		emitByte(OP_NEGATE);
+		op = OP_NEGATE;
 		break;
 	case TOKEN_BANG:
-		emitByte(OP_NOT);
+		op = OP_NOT;
+		break;
+	case TOKEN_TILDE:
+		op = OP_BIT_NOT;
 		break;
 	default:
 		return;
 	}
+
+	Value operand, result;
+	if (foldable(start, &operand) && foldUnary(op, operand, &result)) {
+		dropConstant(start);
+		currentChunk()->count = start;
+		emitConstant(result);
+		return;
+	}
+	emitByte(op);
 }
 
 static void map(bool canAssign) {
@@ -525,6 +962,11 @@ ParseRule rules[] = {
 	{NULL, binary, PREC_FACTOR},	 // TOKEN_MODULO
 	{NULL, map, PREC_CALL},			 // TOKEN_LEFT_BRACKET
 	{NULL, NULL, PREC_NONE},		 // TOKEN_RIGHT_BRACKET
+	{NULL, binary, PREC_BIT_AND},	 // TOKEN_AMPERSAND
+	{NULL, binary, PREC_BIT_OR},	 // TOKEN_PIPE
+	{NULL, binary, PREC_BIT_XOR},	 // TOKEN_CARET
+	{unary, NULL, PREC_NONE},		 // TOKEN_TILDE
+	{NULL, binary, PREC_FACTOR},	 // TOKEN_BACKSLASH
 	{unary, factorial, PREC_UNARY},	 // TOKEN_BANG
 	{NULL, binary, PREC_EQUALITY},	 // TOKEN_BANG_EQUAL
 	{NULL, NULL, PREC_NONE},		 // TOKEN_EQUAL
@@ -533,12 +975,15 @@ ParseRule rules[] = {
 	{NULL, binary, PREC_COMPARISON}, // TOKEN_GREATER_EQUAL
 	{NULL, binary, PREC_COMPARISON}, // TOKEN_LESS
 	{NULL, binary, PREC_COMPARISON}, // TOKEN_LESS_EQUAL
+	{NULL, binary, PREC_SHIFT},		 // TOKEN_GREATER_GREATER
+	{NULL, binary, PREC_SHIFT},		 // TOKEN_LESS_LESS
 	{variable, NULL, PREC_NONE},	 // TOKEN_IDENTIFIER
 	{string, NULL, PREC_NONE},		 // TOKEN_STRING
 	{number, NULL, PREC_NONE},		 // TOKEN_NUMBER
 	{NULL, and_, PREC_AND},			 // TOKEN_AND
 	{NULL, NULL, PREC_NONE},		 // TOKEN_BREAK
 	{NULL, NULL, PREC_NONE},		 // TOKEN_CLASS
+	{NULL, NULL, PREC_NONE},		 // TOKEN_CONST
 	{NULL, NULL, PREC_NONE},		 // TOKEN_ELSE
 	{literal, NULL, PREC_NONE},		 // TOKEN_FALSE
 	{NULL, NULL, PREC_NONE},		 // TOKEN_FOR
@@ -558,6 +1003,7 @@ ParseRule rules[] = {
 };
 
 static void parsePrecedence(Precedence p) {
+	int start = currentChunk()->count;
 	advance();
 	ParseFn prefixRule = getRule(parser.previous.type)->prefix;
 	if (prefixRule == NULL) {
@@ -569,6 +1015,7 @@ static void parsePrecedence(Precedence p) {
 	while (getRule(parser.current.type)->precedence >= p) {
 		advance();
 		ParseFn infixRule = getRule(parser.previous.type)->infix;
+		operandStart = start;
 		infixRule(canAssign);
 	}
 	if (canAssign && match(TOKEN_EQUAL))
@@ -602,6 +1049,8 @@ ObjFunction *compile(const char *src) {
 static void declaration() {
 	if (match(TOKEN_LET)) {
 		varDeclaration();
+	} else if (match(TOKEN_CONST)) {
+		constDeclaration();
 	} else if (match(TOKEN_FUNC)) {
 		funcDeclaration();
 	} else {
@@ -717,7 +1166,7 @@ static void whileStatement() {
 		}
 
 		for (int i = 0; i < leave.length; i++) {
-			emitByte(*(leave.begin + i));
+			emitByte(currentChunk()->code[leave.begin + i]);
 		}
 	}
 	//----------
@@ -800,7 +1249,7 @@ static void forStatement() {
 			}
 		}
 		for (int i = 0; i < leave.length; i++) {
-			emitByte(*(leave.begin + i));
+			emitByte(currentChunk()->code[leave.begin + i]);
 		}
 	}
 	//----------
@@ -817,6 +1266,7 @@ static void synchronize() {
 			return;
 		switch (parser.current.type) {
 		case TOKEN_CLASS:
+		case TOKEN_CONST:
 		case TOKEN_FUNC:
 		case TOKEN_LET:
 		case TOKEN_FOR:
@@ -831,11 +1281,20 @@ static void synchronize() {
 	}
 }
 
-static uint8_t identifierConstant(Token *token) {
+static int identifierConstant(Token *token) {
 	return makeConstant(
 		OBJ_VALUE((Obj *)copyString(token->start, token->length)));
 }
 
+static int identifierGlobal(Token *token) {
+	int slot = globalSlot(copyString(token->start, token->length));
+	if (slot > UINT16_MAX) {
+		error("Too many global variables");
+		return 0;
+	}
+	return slot;
+}
+
 static void addLocal(Token t) {
 	if (current->localCount >= UINT8_COUNT) {
 		error("Too many local variables");
@@ -844,12 +1303,25 @@ static void addLocal(Token t) {
 	Local *loc = &current->locals[current->localCount++];
 	loc->name = t;
 	loc->depth = -1;
+	loc->isCaptured = false;
+	loc->isAssigned = false;
+}
+
+static void checkConstantName(Token *name) {
+	for (int i = current->constantCount - 1; i >= 0; i--) {
+		Constant *c = &current->constants[i];
+		if (c->depth < current->scopeDepth)
+			break;
+		if (identifiersEqual(name, &c->name))
+			error("Constant with that name already declared in this scope");
+	}
 }
 
 static void declareVariable() {
+	Token *name = &parser.previous;
+	checkConstantName(name);
 	if (current->scopeDepth == 0)
 		return;
-	Token *name = &parser.previous;
 
 	for (int i = current->localCount - 1; i >= 0; i--) {
 		Local *l = &current->locals[i];
@@ -865,12 +1337,12 @@ static void declareVariable() {
 	addLocal(*name);
 }
 
-static uint8_t parseVariable(char *error) {
+static int parseVariable(char *error) {
 	consume(TOKEN_IDENTIFIER, error);
 	declareVariable();
 	if (current->scopeDepth > 0)
 		return 0;
-	return identifierConstant(&parser.previous);
+	return identifierGlobal(&parser.previous);
 }
 
 static void markInitialized() {
@@ -879,16 +1351,17 @@ static void markInitialized() {
 	current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
 	if (current->scopeDepth > 0) {
 		markInitialized();
 		return;
 	}
-	emitBytes(OP_DEFINE_GLOBAL, global);
+	emitByte(OP_DEFINE_GLOBAL);
+	emitBytes((global >> 8) & 0xff, global & 0xff);
 }
 
 static void varDeclaration() {
-	uint8_t global = parseVariable("Expected variable name");
+	int global = parseVariable("Expected variable name");
 
 	if (match(TOKEN_EQUAL))
 		expression();
@@ -900,6 +1373,40 @@ static void varDeclaration() {
 	defineVariable(global);
 }
 
+static void constDeclaration() {
+	consume(TOKEN_IDENTIFIER, "Expected constant name");
+	Token name = parser.previous;
+	checkConstantName(&name);
+	for (int i = current->localCount - 1; i >= 0; i--) {
+		Local *l = &current->locals[i];
+		if (l->depth != -1 && l->depth < current->scopeDepth)
+			break;
+		if (identifiersEqual(&name, &l->name))
+			error("Variable with that name already declared in this scope");
+	}
+
+	consume(TOKEN_EQUAL, "Expected '=' after constant name");
+	int start = currentChunk()->count;
+	expression();
+	consume(TOKEN_SEMICOLON, "Expected ';' after constant declaration");
+
+	Value value;
+	if (!foldable(start, &value)) {
+		error("Constant value must be known at compile time");
+		return;
+	}
+	dropConstant(start);
+	currentChunk()->count = start;
+	if (current->constantCount >= UINT8_COUNT) {
+		error("Too many constants in one scope");
+		return;
+	}
+	Constant *c = &current->constants[current->constantCount++];
+	c->name = name;
+	c->depth = current->scopeDepth;
+	c->value = value;
+}
+
 static void breakStatement() {
 	if (current->loopCount <= 0)
 		error("Using break outside loop.");
@@ -925,7 +1432,7 @@ static void function(FunctionType type) {
 			if (++current->function->arity > 255)
 				errorAtCurrent("Cannot have more than 255 function arguments.");
 
-			uint8_t lol = parseVariable("Expected function parameter.");
+			int lol = parseVariable("Expected function parameter.");
 			defineVariable(lol);
 		} while (match(TOKEN_COMMA));
 	}
@@ -935,15 +1442,23 @@ static void function(FunctionType type) {
 	block();
 
 	ObjFunction *func = endCompiler();
-	emitBytes(OP_CLOSURE, makeConstant(OBJ_VALUE((Obj *)func)));
+	int constant = makeConstant(OBJ_VALUE((Obj *)func));
+	emitByte(OP_CLOSURE);
+	emitLong(constant);
 	for (int i = 0; i < func->upvalueCount; i++) {
-		emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+		if (compiler.upvalues[i].isLocal) {
+			// Patched to CAPTURE_LOCAL_VALUE if the local is never reassigned.
+			addCaptureSite(currentChunk()->count, compiler.upvalues[i].index);
+			emitByte(CAPTURE_LOCAL);
+		} else {
+			emitByte(CAPTURE_ENCLOSING);
+		}
 		emitByte(compiler.upvalues[i].index);
 	}
 }
 
 static void funcDeclaration() {
-	uint8_t global = parseVariable("Expected function name");
+	int global = parseVariable("Expected function name");
 	markInitialized();
 	function(TYPE_FUNCTION);
 	defineVariable(global);
@@ -961,6 +1476,11 @@ static void returnStatement() {
 		}
 		expression();
 		consume(TOKEN_SEMICOLON, "Expected ';' after return.");
+		// The OP_RETURN stays for jumps that skip the call, as in 'a and f()'.
+		if (current->callEnd == currentChunk()->count) {
+			uint8_t *op = &currentChunk()->code[current->callStart];
+			*op = *op == OP_CALL ? OP_TAIL_CALL : OP_TAIL_INVOKE;
+		}
 		emitByte(OP_RETURN);
 	}
 }
@@ -970,6 +1490,8 @@ void markCompilerRoots() {
 
 	while (c != NULL) {
 		markObject((Obj *)c->function);
+		for (int i = 0; i < c->constantCount; i++)
+			markValue(c->constants[i].value);
 		c = c->parent;
 	}
 }
@@ -978,7 +1500,7 @@ static void method() {
 	consume(TOKEN_FUNC, "Expected 'func' for a method declaration.");
 	consume(TOKEN_IDENTIFIER, "Expected method name.");
 
-	uint8_t name = identifierConstant(&parser.previous);
+	int name = identifierConstant(&parser.previous);
 	if (parser.previous.length == currentClass->name.length &&
 		memcmp(parser.previous.start, currentClass->name.start,
 			   parser.previous.length) == 0) {
@@ -987,17 +1509,20 @@ static void method() {
 	} else
 		function(TYPE_METHOD);
 
-	emitBytes(OP_METHOD, name);
+	emitByte(OP_METHOD);
+	emitLong(name);
 }
 
 static void classDeclaration() {
 	consume(TOKEN_IDENTIFIER, "Expected class name.");
 	Token className = parser.previous;
-	uint8_t name = identifierConstant(&parser.previous);
+	int name = identifierConstant(&parser.previous);
 
 	declareVariable();
-	emitBytes(OP_CLASS, name);
-	defineVariable(name);
+	emitByte(OP_CLASS);
+	emitLong(name);
+	defineVariable(current->scopeDepth > 0 ? 0
+										   : identifierGlobal(&className));
 
 	ClassCompiler cc;
 	cc.name = className;
@@ -2,6 +2,7 @@
 #include "chunk.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 #include <stdio.h>
 
 void disassembleChunk(Chunk *chunk, char *name) {
@@ -34,22 +35,69 @@ static int constantInstruction(char *name, Chunk *chunk, int offset) {
 	return offset + 2;
 }
 
-static int invokeInstruction(char *name, Chunk *chunk, int offset) {
-	uint8_t constant = chunk->code[offset + 1];
-	uint8_t argCount = chunk->code[offset + 2];
-	printf("%-16s (%d args) %4d '", name, argCount, constant);
+static int readLong(Chunk *chunk, int offset) {
+	return (chunk->code[offset] << 16) | (chunk->code[offset + 1] << 8) |
+		   chunk->code[offset + 2];
+}
+
+static int longConstantInstruction(char *name, Chunk *chunk, int offset) {
+	int constant = readLong(chunk, offset + 1);
+	printf("%-16s %4d '", name, constant);
 	printValue(chunk->constants.values[constant]);
 	printf("'\n");
+	return offset + 4;
+}
+
+static int cacheInstruction(char *name, Chunk *chunk, int offset) {
+	int constant = readLong(chunk, offset + 1);
+	uint16_t cache = chunk->code[offset + 5] | (chunk->code[offset + 4] << 8);
+	printf("%-16s %4d '", name, constant);
+	printValue(chunk->constants.values[constant]);
+	printf("' ic %u\n", cache);
+	return offset + 6;
+}
+
+static int globalInstruction(char *name, Chunk *chunk, int offset) {
+	uint16_t slot = chunk->code[offset + 2] | (chunk->code[offset + 1] << 8);
+	ObjString *global = globalName(slot);
+	printf("%-16s %4u '%s'\n", name, slot,
+		   global != NULL ? global->chars : "?");
 	return offset + 3;
 }
 
+static int localConstantInstruction(char *name, Chunk *chunk, int offset) {
+	uint8_t slot = chunk->code[offset + 1];
+	uint8_t constant = chunk->code[offset + 2];
+	printf("%-16s %4u %4u '", name, slot, constant);
+	printValue(chunk->constants.values[constant]);
+	printf("'\n");
+	return offset + 3;
+}
+
+static int twoByteInstruction(char *name, Chunk *chunk, int offset) {
+	printf("%-16s %4u %4u\n", name, chunk->code[offset + 1],
+		   chunk->code[offset + 2]);
+	return offset + 3;
+}
+
+static int invokeInstruction(char *name, Chunk *chunk, int offset) {
+	int constant = readLong(chunk, offset + 1);
+	uint8_t argCount = chunk->code[offset + 4];
+	uint16_t cache = chunk->code[offset + 6] | (chunk->code[offset + 5] << 8);
+	printf("%-16s (%d args) %4d '", name, argCount, constant);
+	printValue(chunk->constants.values[constant]);
+	printf("' ic %u\n", cache);
+	return offset + 7;
+}
+
 int disassembleInstruction(Chunk *chunk, int offset) {
 	printf("%04d ", offset);
 
-	if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+	int line = getLine(chunk, offset);
+	if (offset > 0 && line == getLine(chunk, offset - 1)) {
 		printf("   | ");
 	} else {
-		printf("%4d ", chunk->lines[offset]);
+		printf("%4d ", line);
 	}
 
 	uint8_t instruction = chunk->code[offset];
@@ -115,13 +163,13 @@ int disassembleInstruction(Chunk *chunk, int offset) {
 		return simpleInstruction("OP_POP", offset);
 	}
 	case OP_DEFINE_GLOBAL: {
-		return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+		return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
 	}
 	case OP_GET_GLOBAL: {
-		return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+		return globalInstruction("OP_GET_GLOBAL", chunk, offset);
 	}
 	case OP_SET_GLOBAL: {
-		return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+		return globalInstruction("OP_SET_GLOBAL", chunk, offset);
 	}
 	case OP_GET_LOCAL: {
 		return byteInstruction("OP_GET_LOCAL", chunk, offset);
@@ -148,17 +196,20 @@ int disassembleInstruction(Chunk *chunk, int offset) {
 		return byteInstruction("OP_CALL", chunk, offset);
 	}
 	case OP_CLOSURE: {
-		offset++;
-		uint8_t constant = chunk->code[offset++];
+		int constant = readLong(chunk, offset + 1);
+		offset += 4;
 		printf("%-16s %4d ", "OP_CLOSURE", constant);
 		printValue(chunk->constants.values[constant]);
 		puts("");
 		ObjFunction *func = AS_FUNCTION(chunk->constants.values[constant]);
 		for (int j = 0; j < func->upvalueCount; j++) {
-			int isLocal = chunk->code[offset++];
+			int kind = chunk->code[offset++];
 			int index = chunk->code[offset++];
 			printf("%04d      |                     %s %d\n", offset - 2,
-				   isLocal ? "local" : "upvalue", index);
+				   kind == CAPTURE_ENCLOSING ? "upvalue"
+				   : kind == CAPTURE_LOCAL	 ? "local"
+											 : "value",
+				   index);
 		}
 		return offset;
 	}
@@ -171,15 +222,84 @@ int disassembleInstruction(Chunk *chunk, int offset) {
 	case OP_MAP:
 		return simpleInstruction("OP_MAP", offset);
 	case OP_CLASS:
-		return constantInstruction("OP_CLASS", chunk, offset);
+		return longConstantInstruction("OP_CLASS", chunk, offset);
 	case OP_SET_FIELD:
-		return constantInstruction("OP_SET_FIELD", chunk, offset);
+		return cacheInstruction("OP_SET_FIELD", chunk, offset);
 	case OP_GET_FIELD:
-		return constantInstruction("OP_GET_FIELD", chunk, offset);
+		return cacheInstruction("OP_GET_FIELD", chunk, offset);
 	case OP_METHOD:
-		return constantInstruction("OP_METHOD", chunk, offset);
+		return longConstantInstruction("OP_METHOD", chunk, offset);
 	case OP_INVOKE:
 		return invokeInstruction("OP_INVOKE", chunk, offset);
+	case OP_INT_DIV:
+		return simpleInstruction("OP_INT_DIV", offset);
+	case OP_BIT_AND:
+		return simpleInstruction("OP_BIT_AND", offset);
+	case OP_BIT_OR:
+		return simpleInstruction("OP_BIT_OR", offset);
+	case OP_BIT_XOR:
+		return simpleInstruction("OP_BIT_XOR", offset);
+	case OP_BIT_NOT:
+		return simpleInstruction("OP_BIT_NOT", offset);
+	case OP_SHIFT_LEFT:
+		return simpleInstruction("OP_SHIFT_LEFT", offset);
+	case OP_SHIFT_RIGHT:
+		return simpleInstruction("OP_SHIFT_RIGHT", offset);
+	case OP_CONSTANT_LONG:
+		return longConstantInstruction("OP_CONSTANT_LONG", chunk, offset);
+	case OP_TAIL_CALL:
+		return byteInstruction("OP_TAIL_CALL", chunk, offset);
+	case OP_TAIL_INVOKE:
+		return invokeInstruction("OP_TAIL_INVOKE", chunk, offset);
+	case OP_GET_LOCAL_LOCAL:
+		return twoByteInstruction("OP_GET_LOCAL_LOCAL", chunk, offset);
+	case OP_ADD_LOCAL_CONST:
+		return localConstantInstruction("OP_ADD_LOCAL_CONST", chunk, offset);
+	case OP_GET_THIS_FIELD:
+		return cacheInstruction("OP_GET_THIS_FIELD", chunk, offset);
+	case OP_LESS_JUMP_IF_FALSE:
+		return shortInstruction("OP_LESS_JUMP_IF_FALSE", chunk, offset);
+	case OP_LESS_EQUAL_JUMP_IF_FALSE:
+		return shortInstruction("OP_LESS_EQUAL_JUMP_IF_FALSE", chunk, offset);
+	case OP_GREATER_JUMP_IF_FALSE:
+		return shortInstruction("OP_GREATER_JUMP_IF_FALSE", chunk, offset);
+	case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+		return shortInstruction("OP_GREATER_EQUAL_JUMP_IF_FALSE", chunk,
+								offset);
+	case OP_POP_LOOP:
+		return shortInstruction("OP_POP_LOOP", chunk, offset);
+	case OP_ADD_NUM:
+		return simpleInstruction("OP_ADD_NUM", offset);
+	case OP_ADD_STR:
+		return simpleInstruction("OP_ADD_STR", offset);
+	case OP_SUB_NUM:
+		return simpleInstruction("OP_SUB_NUM", offset);
+	case OP_MUL_NUM:
+		return simpleInstruction("OP_MUL_NUM", offset);
+	case OP_DIV_NUM:
+		return simpleInstruction("OP_DIV_NUM", offset);
+	case OP_LESS_NUM:
+		return simpleInstruction("OP_LESS_NUM", offset);
+	case OP_LESS_EQUAL_NUM:
+		return simpleInstruction("OP_LESS_EQUAL_NUM", offset);
+	case OP_GREATER_NUM:
+		return simpleInstruction("OP_GREATER_NUM", offset);
+	case OP_GREATER_EQUAL_NUM:
+		return simpleInstruction("OP_GREATER_EQUAL_NUM", offset);
+	case OP_ADD_INT:
+		return simpleInstruction("OP_ADD_INT", offset);
+	case OP_SUB_INT:
+		return simpleInstruction("OP_SUB_INT", offset);
+	case OP_MUL_INT:
+		return simpleInstruction("OP_MUL_INT", offset);
+	case OP_LESS_INT:
+		return simpleInstruction("OP_LESS_INT", offset);
+	case OP_LESS_EQUAL_INT:
+		return simpleInstruction("OP_LESS_EQUAL_INT", offset);
+	case OP_GREATER_INT:
+		return simpleInstruction("OP_GREATER_INT", offset);
+	case OP_GREATER_EQUAL_INT:
+		return simpleInstruction("OP_GREATER_EQUAL_INT", offset);
 	default: {
 		printf("unknown upcode: 0x%x\n", instruction);
 		return offset + 1;
@@ -0,0 +1,103 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// String hashes are seeded with this. It only changes which strings collide
+// and the order tables keep their keys in.
+#ifndef HASH_SEED
+#define HASH_SEED 0
+#endif
+
+// wyhash (final version, public domain) reading 8 bytes at a time, folded to
+// 32 bits.
+
+static inline uint64_t hashRead8(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static inline uint64_t hashRead4(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+// Multiplies a and b, leaving the low half of the product in a and the high
+// half in b.
+static inline void hashMultiply(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), lo = t + (rm1 << 32);
+	uint64_t carry = (t < rl) + (lo < t);
+	*a = lo;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+#endif
+}
+
+static inline uint64_t hashMix(uint64_t a, uint64_t b) {
+	hashMultiply(&a, &b);
+	return a ^ b;
+}
+
+static inline uint32_t hashBytes(const char *key, size_t length,
+								 uint64_t seed) {
+	static const uint64_t s0 = 0xa0761d6478bd642full;
+	static const uint64_t s1 = 0xe7037ed1a0b428dbull;
+	static const uint64_t s2 = 0x8ebc6af09c88c6e3ull;
+	static const uint64_t s3 = 0x589965cc75374cc3ull;
+	const uint8_t *p = (const uint8_t *)key;
+	uint64_t a, b;
+	seed ^= hashMix(seed ^ s0, s1);
+	if (length <= 16) {
+		if (length >= 4) {
+			size_t middle = (length >> 3) << 2;
+			a = (hashRead4(p) << 32) | hashRead4(p + middle);
+			b = (hashRead4(p + length - 4) << 32) |
+				hashRead4(p + length - 4 - middle);
+		} else if (length > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) |
+				p[length - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = length;
+		if (i > 48) {
+			uint64_t seed1 = seed, seed2 = seed;
+			do {
+				seed = hashMix(hashRead8(p) ^ s1, hashRead8(p + 8) ^ seed);
+				seed1 =
+					hashMix(hashRead8(p + 16) ^ s2, hashRead8(p + 24) ^ seed1);
+				seed2 =
+					hashMix(hashRead8(p + 32) ^ s3, hashRead8(p + 40) ^ seed2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= seed1 ^ seed2;
+		}
+		while (i > 16) {
+			seed = hashMix(hashRead8(p) ^ s1, hashRead8(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = hashRead8(p + i - 16);
+		b = hashRead8(p + i - 8);
+	}
+	a ^= s1;
+	b ^= seed;
+	hashMultiply(&a, &b);
+	uint64_t h = hashMix(a ^ s0 ^ length, b ^ s1);
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+#endif
\ No newline at end of file
@@ -1,9 +1,11 @@
 #include "chunk.h"
 #include "commons.h"
 #include "dbg.h"
+#include "optimizer.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define OUT_BUF_SIZE 8192
 
@@ -20,10 +22,16 @@ int main(int argc, char *argv[]) {
 #ifndef DEBUG_BUILD
 
 	if (argc == 1) {
-		printf("Usage: lmao <filename>\n");
+		printf("Usage: lmao [-O0] <filename>\n");
 		return 1;
 	} else if (argc == 2) {
 		runFile(argv[1]);
+	} else if (argc == 3 && strcmp(argv[1], "-O0") == 0) {
+		optimizeBytecode = false;
+		runFile(argv[2]);
+	} else {
+		printf("Usage: lmao [-O0] <filename>\n");
+		return 1;
 	}
 
 #else
@@ -60,6 +68,7 @@ void runFile(char *name) {
 
 	InterpretResult i = interpret(src);
 	free(src);
+	freeVM();
 
 	if (i == INTERPRET_OK) {
 
@@ -1,24 +1,48 @@
+// sysconf() and sched_yield() for parallel marking.
+#define _POSIX_C_SOURCE 200809L
+
 #include "mem.h"
 #include "commons.h"
 #include "compiler.h"
 #include "object.h"
 #include "vm.h"
+#include <limits.h>
 #include <stdlib.h>
 
 #ifdef DEBUG_LOGGC
 #include "dbg.h"
 #include <stdio.h>
 #endif
+
+#ifdef PARALLEL_MARK
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#endif
+static bool collectGarbage();
+static void markArray(ValueArray *arr);
+static void blackenObject(Obj *obj);
+
+// Set during minor collections, which treat old objects as reachable.
+static bool collectingYoung = false;
+
 void *reallocate(void *previous, size_t oldSize, size_t newSize) {
 	vm.bytesAllocated += newSize - oldSize;
 
 	if (newSize > oldSize) {
-#ifdef DEBUG_STRESSGC
-		gc();
-#endif
-		if (vm.bytesAllocated > vm.nextGC) {
-			gc();
+		vm.youngBytes += newSize - oldSize;
+#ifdef DEBUG_GC_PAUSES
+		clock_t start = clock();
+		if (collectGarbage()) {
+			clock_t pause = clock() - start;
+			vm.gcPauses++;
+			if (pause > vm.longestGCPause)
+				vm.longestGCPause = pause;
 		}
+#else
+		collectGarbage();
+#endif
 	}
 
 	if (newSize == 0) {
@@ -36,8 +60,7 @@ static void freeObject(Obj *b) {
 	switch (b->type) {
 	case OBJ_STRING: {
 		ObjString *str = (ObjString *)b;
-		FREE_ARRAY(char, str->chars, str->length + 1);
-		FREE(ObjString, str);
+		reallocate(str, STRING_SIZE(str->length), 0);
 		break;
 	}
 	case OBJ_FUNCTION: {
@@ -52,8 +75,7 @@ static void freeObject(Obj *b) {
 	}
 	case OBJ_CLOSURE: {
 		ObjClosure *c = (ObjClosure *)b;
-		FREE_ARRAY(ObjUpvalue *, c->upvalues, c->upvalueCount);
-		FREE(ObjClosure, c);
+		reallocate(c, CLOSURE_SIZE(c->upvalueCount, c->cellCount), 0);
 		break;
 	}
 	case OBJ_UPV: {
@@ -68,12 +90,31 @@ static void freeObject(Obj *b) {
 	}
 	case OBJ_INSTANCE: {
 		ObjInstance *instance = (ObjInstance *)b;
-		freeTable(&instance->fields);
-		FREE(ObjInstance, instance);
+		if (instance->fields != NULL) {
+			freeTable(instance->fields);
+			FREE(Table, instance->fields);
+		}
+		if (instance->slots != instance->inlineSlots)
+			FREE_ARRAY(Value, instance->slots, instance->capacity);
+		reallocate(instance,
+				   sizeof(ObjInstance) +
+					   sizeof(Value) * instance->inlineCapacity,
+				   0);
+		break;
+	}
+	case OBJ_SHAPE: {
+		ObjShape *shape = (ObjShape *)b;
+		freeTable(&shape->transitions);
+		FREE(ObjShape, shape);
 		break;
 	}
 	case OBJ_METHOD: {
 		FREE(ObjMethod, b);
+		break;
+	}
+	case OBJ_ROPE: {
+		FREE(ObjRope, b);
+		break;
 	}
 	}
 }
@@ -81,14 +122,292 @@ static void freeObject(Obj *b) {
 void freeObjects() {
 	Obj *object = vm.objects;
 	while (object != NULL) {
-		Obj *next = object->next;
+		Obj *next = objNext(object);
 		freeObject(object);
 		object = next;
 	}
 }
 
+#ifdef PARALLEL_MARK
+// Long traces are shared between marker threads while the program waits.
+// Each marker keeps its grey objects in its own Chase-Lev deque: the owner
+// pushes and pops at the bottom, the others steal from the top once they run
+// out. Mark bits are set with an atomic or on the header word, so only one
+// marker greys any object.
+
+typedef struct GreyBuffer {
+	int64_t capacity;
+	// The smaller buffer this one replaced. Thieves may still be reading it
+	// until the trace ends.
+	struct GreyBuffer *retired;
+	Obj *items[];
+} GreyBuffer;
+
+typedef struct {
+	int64_t top;
+	int64_t bottom;
+	GreyBuffer *buffer;
+	pthread_t thread;
+	uint32_t seed;
+} Marker;
+
+typedef uint64_t __attribute__((may_alias)) HeaderWord;
+
+static Marker markers[MAX_MARK_THREADS];
+static int markerCount = 0;
+// The marker the current thread pushes to, NULL outside of parallel traces.
+static __thread Marker *marker = NULL;
+static uint64_t markedBit;
+static uint64_t oldBit;
+
+static int idleMarkers;
+static int runningHelpers;
+static unsigned int markRound = 0;
+static bool stopMarkers = false;
+static pthread_mutex_t markLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markStart = PTHREAD_COND_INITIALIZER;
+
+static GreyBuffer *newGreyBuffer(int64_t capacity) {
+	GreyBuffer *buffer =
+		malloc(sizeof(GreyBuffer) + sizeof(Obj *) * (size_t)capacity);
+	if (buffer == NULL)
+		exit(1);
+	buffer->capacity = capacity;
+	buffer->retired = NULL;
+	return buffer;
+}
+
+static GreyBuffer *growGrey(Marker *m, int64_t top, int64_t bottom) {
+	GreyBuffer *old = m->buffer;
+	GreyBuffer *buffer = newGreyBuffer(old->capacity * 2);
+	for (int64_t i = top; i < bottom; i++)
+		buffer->items[i & (buffer->capacity - 1)] =
+			old->items[i & (old->capacity - 1)];
+	buffer->retired = old;
+	__atomic_store_n(&m->buffer, buffer, __ATOMIC_RELEASE);
+	return buffer;
+}
+
+static void pushGrey(Marker *m, Obj *obj) {
+	int64_t bottom = __atomic_load_n(&m->bottom, __ATOMIC_RELAXED);
+	int64_t top = __atomic_load_n(&m->top, __ATOMIC_ACQUIRE);
+	GreyBuffer *buffer = m->buffer;
+	if (bottom - top >= buffer->capacity)
+		buffer = growGrey(m, top, bottom);
+	__atomic_store_n(&buffer->items[bottom & (buffer->capacity - 1)], obj,
+					 __ATOMIC_RELAXED);
+	__atomic_store_n(&m->bottom, bottom + 1, __ATOMIC_RELEASE);
+}
+
+static Obj *popGrey(Marker *m) {
+	int64_t bottom = __atomic_load_n(&m->bottom, __ATOMIC_RELAXED) - 1;
+	GreyBuffer *buffer = m->buffer;
+	__atomic_store_n(&m->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t top = __atomic_load_n(&m->top, __ATOMIC_RELAXED);
+
+	if (top > bottom) {
+		__atomic_store_n(&m->bottom, bottom + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	Obj *obj = __atomic_load_n(&buffer->items[bottom & (buffer->capacity - 1)],
+							   __ATOMIC_RELAXED);
+	if (top == bottom) {
+		// The last one, which a thief may be taking as well.
+		if (!__atomic_compare_exchange_n(&m->top, &top, top + 1, false,
+										 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			obj = NULL;
+		__atomic_store_n(&m->bottom, bottom + 1, __ATOMIC_RELAXED);
+	}
+	return obj;
+}
+
+// Returns NULL when m is empty or another thread won the race.
+static Obj *stealGrey(Marker *m) {
+	int64_t top = __atomic_load_n(&m->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t bottom = __atomic_load_n(&m->bottom, __ATOMIC_ACQUIRE);
+	if (top >= bottom)
+		return NULL;
+
+	GreyBuffer *buffer = __atomic_load_n(&m->buffer, __ATOMIC_ACQUIRE);
+	Obj *obj = __atomic_load_n(&buffer->items[top & (buffer->capacity - 1)],
+							   __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&m->top, &top, top + 1, false,
+									 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return obj;
+}
+
+static Obj *stealAny(Marker *self) {
+	// xorshift, so that idle markers don't all pick the same victim.
+	self->seed ^= self->seed << 13;
+	self->seed ^= self->seed >> 17;
+	self->seed ^= self->seed << 5;
+	int start = (int)(self->seed % (uint32_t)markerCount);
+	for (int i = 0; i < markerCount; i++) {
+		Marker *victim = &markers[(start + i) % markerCount];
+		if (victim == self)
+			continue;
+		Obj *obj = stealGrey(victim);
+		if (obj != NULL)
+			return obj;
+	}
+	return NULL;
+}
+
+static bool anyGrey() {
+	for (int i = 0; i < markerCount; i++) {
+		if (__atomic_load_n(&markers[i].top, __ATOMIC_SEQ_CST) <
+			__atomic_load_n(&markers[i].bottom, __ATOMIC_SEQ_CST))
+			return true;
+	}
+	return false;
+}
+
+static void markShared(Obj *obj) {
+	HeaderWord *header = (HeaderWord *)obj;
+	uint64_t word = __atomic_load_n(header, __ATOMIC_RELAXED);
+	if ((word & markedBit) || (collectingYoung && (word & oldBit)))
+		return;
+	if (__atomic_fetch_or(header, markedBit, __ATOMIC_RELAXED) & markedBit)
+		return;
+	pushGrey(marker, obj);
+}
+
+// Blackens grey objects until no marker has any left. A marker only counts
+// as idle with an empty deque and nothing in hand, so once all of them are
+// idle there is no grey object anywhere.
+static void drainMarkers(Marker *self) {
+	for (;;) {
+		Obj *obj;
+		while ((obj = popGrey(self)) != NULL || (obj = stealAny(self)) != NULL)
+			blackenObject(obj);
+
+		__atomic_add_fetch(&idleMarkers, 1, __ATOMIC_SEQ_CST);
+		for (;;) {
+			if (__atomic_load_n(&idleMarkers, __ATOMIC_SEQ_CST) == markerCount)
+				return;
+			if (anyGrey()) {
+				__atomic_sub_fetch(&idleMarkers, 1, __ATOMIC_SEQ_CST);
+				break;
+			}
+			sched_yield();
+		}
+	}
+}
+
+static void *markerThread(void *arg) {
+	marker = arg;
+	unsigned int round = 0;
+	pthread_mutex_lock(&markLock);
+	for (;;) {
+		while (markRound == round && !stopMarkers)
+			pthread_cond_wait(&markStart, &markLock);
+		if (stopMarkers)
+			break;
+		round = markRound;
+		pthread_mutex_unlock(&markLock);
+
+		drainMarkers(marker);
+		__atomic_sub_fetch(&runningHelpers, 1, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&markLock);
+	}
+	pthread_mutex_unlock(&markLock);
+	return NULL;
+}
+
+// Marker 0 is the thread running the program, the others are started the
+// first time a trace is long enough to share.
+static void startMarkers() {
+	Obj header;
+	memset(&header, 0, sizeof(Obj));
+	header.isMarked = true;
+	memcpy(&markedBit, &header, sizeof(uint64_t));
+	header.isMarked = false;
+	header.isOld = true;
+	memcpy(&oldBit, &header, sizeof(uint64_t));
+
+#ifdef GC_MARK_THREADS
+	long count = GC_MARK_THREADS;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (count < 1)
+		count = 1;
+	if (count > MAX_MARK_THREADS)
+		count = MAX_MARK_THREADS;
+
+	markerCount = 1;
+	for (int i = 0; i < count; i++) {
+		Marker *m = &markers[i];
+		m->top = 0;
+		m->bottom = 0;
+		m->buffer = newGreyBuffer(1024);
+		m->seed = 2654435761u * (uint32_t)(i + 1);
+		if (i > 0) {
+			if (pthread_create(&m->thread, NULL, markerThread, m) != 0) {
+				free(m->buffer);
+				break;
+			}
+			markerCount++;
+		}
+	}
+}
+
+// Hands the grey stack to marker 0 and traces it with every marker.
+static void traceInParallel() {
+	marker = &markers[0];
+	while (vm.greyCount > 0)
+		pushGrey(marker, vm.greyStack[--vm.greyCount]);
+
+	idleMarkers = 0;
+	runningHelpers = markerCount - 1;
+	pthread_mutex_lock(&markLock);
+	markRound++;
+	pthread_cond_broadcast(&markStart);
+	pthread_mutex_unlock(&markLock);
+
+	drainMarkers(marker);
+	while (__atomic_load_n(&runningHelpers, __ATOMIC_ACQUIRE) > 0)
+		sched_yield();
+	marker = NULL;
+
+	for (int i = 0; i < markerCount; i++) {
+		GreyBuffer *retired = markers[i].buffer->retired;
+		markers[i].buffer->retired = NULL;
+		while (retired != NULL) {
+			GreyBuffer *next = retired->retired;
+			free(retired);
+			retired = next;
+		}
+	}
+}
+
+void freeMarkers() {
+	pthread_mutex_lock(&markLock);
+	stopMarkers = true;
+	pthread_cond_broadcast(&markStart);
+	pthread_mutex_unlock(&markLock);
+	for (int i = 0; i < markerCount; i++) {
+		if (i > 0)
+			pthread_join(markers[i].thread, NULL);
+		free(markers[i].buffer);
+	}
+	markerCount = 0;
+}
+#endif
+
 void markObject(Obj *obj) {
-	if (obj == NULL || obj->isMarked)
+	if (obj == NULL)
+		return;
+#ifdef PARALLEL_MARK
+	if (marker != NULL) {
+		markShared(obj);
+		return;
+	}
+#endif
+	if (obj->isMarked || (collectingYoung && obj->isOld))
 		return;
 	obj->isMarked = true;
 
@@ -114,16 +433,42 @@ void markValue(Value val) {
 
 void markTable(Table *t) {
 	for (int i = 0; i < t->capacity; i++) {
+		if (t->entries[i].key == NULL)
+			continue;
 		markObject((Obj *)(t->entries[i].key));
 		markValue(t->entries[i].value);
 	}
 }
 
+void rememberObject(Obj *obj) {
+	if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+		vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+		vm.remembered =
+			realloc(vm.remembered, vm.rememberedCapacity * sizeof(Obj *));
+		if (vm.remembered == NULL)
+			exit(1);
+	}
+	obj->isRemembered = true;
+	vm.remembered[vm.rememberedCount++] = obj;
+}
+
+// Survivors of a collection are all old, so nothing old points at anything
+// young any more.
+static void forgetRemembered() {
+	for (int i = 0; i < vm.rememberedCount; i++)
+		vm.remembered[i]->isRemembered = false;
+	vm.rememberedCount = 0;
+}
+
 static void markRoots() {
 	for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
 		markValue(*slot);
 	}
-	markTable(&vm.globals);
+	markTable(&vm.globalNames);
+	markArray(&vm.globalValues);
+	for (int i = 0; i < UINT8_COUNT; i++) {
+		markObject((Obj *)vm.byteStrings[i]);
+	}
 	for (int i = 0; i < vm.frameCount; i++) {
 		markObject((Obj *)vm.frames[i].closure);
 	}
@@ -155,26 +500,46 @@ static void blackenObject(Obj *obj) {
 		ObjFunction *func = (ObjFunction *)obj;
 		markObject((Obj *)func->name);
 		markArray(&func->chunk.constants);
+		for (int i = 0; i < func->chunk.cacheCount; i++) {
+			InlineCache *cache = &func->chunk.caches[i];
+			int count = cache->count < IC_ENTRIES ? cache->count : IC_ENTRIES;
+			for (int j = 0; j < count; j++) {
+				markObject((Obj *)cache->entries[j].shape);
+				markObject((Obj *)cache->entries[j].transition);
+				markValue(cache->entries[j].method);
+			}
+		}
 		break;
 	}
 	case OBJ_CLOSURE: {
 		ObjClosure *closure = (ObjClosure *)obj;
 		markObject((Obj *)closure->func);
 		for (int i = 0; i < closure->upvalueCount; i++) {
-			markObject((Obj *)closure->upvalues[i]);
+			if (!isClosureCell(closure, closure->upvalues[i]))
+				markObject((Obj *)closure->upvalues[i]);
 		}
+		for (int i = 0; i < closure->cellCount; i++)
+			markValue(closure->cells[i].closed);
 		break;
 	}
 	case OBJ_CLASS: {
 		ObjClass *klass = (ObjClass *)obj;
 		markObject((Obj *)klass->name);
+		markObject((Obj *)klass->shape);
 		markTable(&klass->methods);
 		break;
 	}
 	case OBJ_INSTANCE: {
 		ObjInstance *instance = (ObjInstance *)obj;
 		markObject((Obj *)instance->klass);
-		markTable(&instance->fields);
+		if (instance->shape != NULL) {
+			markObject((Obj *)instance->shape);
+			for (int i = 0; i < instance->shape->fieldCount; i++) {
+				markValue(instance->slots[i]);
+			}
+		} else {
+			markTable(instance->fields);
+		}
 		break;
 	}
 	case OBJ_METHOD: {
@@ -183,6 +548,20 @@ static void blackenObject(Obj *obj) {
 		markValue(m->parent);
 		break;
 	}
+	case OBJ_SHAPE: {
+		ObjShape *shape = (ObjShape *)obj;
+		markObject((Obj *)shape->parent);
+		markObject((Obj *)shape->name);
+		markTable(&shape->transitions);
+		break;
+	}
+	case OBJ_ROPE: {
+		ObjRope *rope = (ObjRope *)obj;
+		markObject(rope->left);
+		markObject(rope->right);
+		markObject((Obj *)rope->flat);
+		break;
+	}
 	}
 
 #ifdef DEBUG_LOGGC
@@ -193,25 +572,41 @@ static void blackenObject(Obj *obj) {
 }
 
 static void traceReferences() {
+#ifdef PARALLEL_MARK
+	// Short traces aren't worth waking the other markers for.
+	for (int budget = PARALLEL_MARK_MIN; vm.greyCount && budget > 0; budget--)
+		blackenObject(vm.greyStack[--vm.greyCount]);
+	if (vm.greyCount == 0)
+		return;
+	if (markerCount == 0)
+		startMarkers();
+	if (markerCount > 1) {
+		traceInParallel();
+		return;
+	}
+#endif
 	while (vm.greyCount) {
 		blackenObject((vm.greyStack[--vm.greyCount]));
 	}
 }
 
-static void sweep() {
+// New objects are pushed onto the front of vm.objects, so the young ones come
+// before the first old one.
+static void sweepYoung() {
 	Obj *current = vm.objects;
 	Obj *previous = NULL;
-	while (current != NULL) {
+	while (current != NULL && !current->isOld) {
 		if (current->isMarked) {
 			current->isMarked = false;
+			current->isOld = true;
 			previous = current;
-			current = current->next;
+			current = objNext(current);
 		} else {
 			Obj *unreached = current;
 
-			current = current->next;
+			current = objNext(current);
 			if (previous != NULL) {
-				previous->next = current;
+				setObjNext(previous, current);
 			} else {
 				vm.objects = current;
 			}
@@ -220,25 +615,154 @@ static void sweep() {
 	}
 }
 
-void gc() {
+// Frees objects allocated since the last collection that are unreachable
+// from the roots and from remembered old objects. Only runs between full
+// cycles.
+static void minorCollection() {
 
 #ifdef DEBUG_LOGGC
-	printf("-------Garbage Collector--------\n");
+	printf("-------Minor collection--------\n");
 	size_t before = vm.bytesAllocated;
 #endif
 
+	collectingYoung = true;
+	markRoots();
+	for (int i = 0; i < vm.rememberedCount; i++)
+		blackenObject(vm.remembered[i]);
+	traceReferences();
+	tableRemoveWhite(&vm.strings, true);
+	forgetRemembered();
+	sweepYoung();
+	collectingYoung = false;
+	vm.youngBytes = 0;
+
+#ifdef DEBUG_LOGGC
+	printf("   collected %I64u bytes (from %I64u to %I64u)\n",
+		   before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+}
+
+// Full collections are incremental. Marking greys the roots, then each step
+// blackens a bounded number of grey objects while the program keeps
+// running. Objects allocated meanwhile start grey, and the write barrier
+// greys anything stored into an object that is already marked.
+static void startCycle() {
+
+#ifdef DEBUG_LOGGC
+	printf("-------Garbage Collector--------\n");
+#endif
+
+	vm.gcPhase = GC_MARKING;
+	markRoots();
+	vm.youngBytes = 0;
+}
+
+// Roots are written without a barrier, so they are marked again once the
+// grey objects run out, and whatever that reaches is traced right away.
+static void finishMarking() {
 	markRoots();
 	traceReferences();
-	tableRemoveWhite(&vm.strings);
-	sweep();
+	tableRemoveWhite(&vm.strings, false);
+	// Everything marked is promoted by the sweep, and until then the barrier
+	// treats marked objects as old.
+	forgetRemembered();
+	vm.gcPhase = GC_SWEEPING;
+	vm.sweepCurrent = vm.objects;
+	vm.sweepPrevious = NULL;
+}
+
+// Objects allocated while sweeping go in front of the ones still to be swept
+// and stay unmarked and young.
+static void sweepStep(int budget) {
+	while (vm.sweepCurrent != NULL && budget-- > 0) {
+		Obj *current = vm.sweepCurrent;
+		Obj *next = objNext(current);
+		if (current->isMarked) {
+			current->isMarked = false;
+			current->isOld = true;
+			vm.sweepPrevious = current;
+		} else {
+			if (vm.sweepPrevious == NULL && vm.objects != current) {
+				// Something was allocated in front of current since the sweep
+				// began.
+				Obj *previous = vm.objects;
+				while (objNext(previous) != current)
+					previous = objNext(previous);
+				vm.sweepPrevious = previous;
+			}
+			if (vm.sweepPrevious != NULL)
+				setObjNext(vm.sweepPrevious, next);
+			else
+				vm.objects = next;
+			freeObject(current);
+		}
+		vm.sweepCurrent = next;
+	}
 
-	vm.nextGC = vm.bytesAllocated * 5;
+	if (vm.sweepCurrent == NULL) {
+		vm.gcPhase = GC_IDLE;
+		vm.nextGC = vm.bytesAllocated * 5;
 
 #ifdef DEBUG_LOGGC
+		printf("   done, %I64u bytes in use, next at %I64u\n",
+			   vm.bytesAllocated, vm.nextGC);
+		printf("-------Garbage Collector end--------\n");
+#endif
+	}
+}
 
-	printf("   collected %I64u bytes (from %I64u to %I64u) next at %I64u\n",
-		   before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+// Does up to budget objects' worth of marking or sweeping.
+static void gcStep(int budget) {
+	if (vm.gcPhase == GC_MARKING) {
+		while (vm.greyCount > 0 && budget-- > 0)
+			blackenObject(vm.greyStack[--vm.greyCount]);
+		if (vm.greyCount == 0)
+			finishMarking();
+	} else {
+		sweepStep(budget);
+	}
+	vm.youngBytes = 0;
+}
 
-	printf("-------Garbage Collector end--------\n");
+// Runs whatever collection work is due after an allocation and returns
+// whether there was any.
+static bool collectGarbage() {
+#ifdef DEBUG_STRESSGC
+	// Every allocation does some work, and every eighth one that isn't in
+	// the middle of a full cycle starts one.
+	static int stressCount = 0;
+	if (vm.gcPhase != GC_IDLE) {
+		gcStep(4);
+	} else if (++stressCount % 8 == 0) {
+		startCycle();
+	} else {
+		minorCollection();
+	}
+	return true;
+#else
+	if (vm.gcPhase != GC_IDLE) {
+		if (vm.youngBytes < GC_STEP_SIZE)
+			return false;
+		gcStep(GC_STEP_WORK);
+	} else if (vm.bytesAllocated > vm.nextGC) {
+		startCycle();
+	} else if (vm.youngBytes > NURSERY_SIZE) {
+		minorCollection();
+	} else {
+		return false;
+	}
+	return true;
 #endif
+}
+
+// Finishes any cycle in progress and runs a complete one.
+void gc() {
+	if (vm.gcPhase == GC_MARKING)
+		traceReferences();
+	while (vm.gcPhase != GC_IDLE)
+		gcStep(INT_MAX);
+	startCycle();
+	traceReferences();
+	while (vm.gcPhase != GC_IDLE)
+		gcStep(INT_MAX);
 }
\ No newline at end of file
@@ -1,8 +1,25 @@
 #ifndef MEM_H
 #define MEM_H
 
+#include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
+
+// Allocating this many bytes since the last collection starts a minor one,
+// which only frees objects allocated in the meantime.
+#define NURSERY_SIZE (256 * 1024)
+// While a full collection is in progress, every GC_STEP_SIZE bytes allocated
+// mark or sweep about GC_STEP_WORK objects. More work per step means shorter
+// cycles and longer pauses.
+#define GC_STEP_SIZE (16 * 1024)
+#define GC_STEP_WORK 2000
+// With PARALLEL_MARK, traces left with grey objects after this many are
+// shared with up to MAX_MARK_THREADS threads, one per core unless
+// GC_MARK_THREADS says otherwise.
+#define PARALLEL_MARK_MIN 1024
+#define MAX_MARK_THREADS 16
+
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : ((capacity)*2))
 
 void *reallocate(void *previous, size_t oldSize, size_t newSize);
@@ -17,9 +34,37 @@ void *reallocate(void *previous, size_t oldSize, size_t newSize);
 
 #define FREE(type, pointer) (reallocate(pointer, sizeof(type), 0))
 
-void markTable(Table* t);
 void markObject(Obj* val);
+void rememberObject(Obj *obj);
+
+// Call after storing child in owner. While marking, children of marked
+// objects are greyed so a marked object never points at an unmarked one the
+// cycle won't reach. Otherwise old objects pointing at young ones are
+// remembered, minor collections don't look at old objects. Marked objects
+// outside of marking are ones the sweep hasn't promoted yet, so they count
+// as old.
+static inline void writeBarrier(Obj *owner, Obj *child) {
+	if (child == NULL)
+		return;
+	if (vm.gcPhase == GC_MARKING) {
+		if (owner->isMarked)
+			markObject(child);
+	} else if (!child->isOld && !owner->isRemembered &&
+			   (owner->isOld || owner->isMarked)) {
+		rememberObject(owner);
+	}
+}
+
+static inline void writeBarrierValue(Obj *owner, Value value) {
+	if (IS_OBJ(value))
+		writeBarrier(owner, AS_OBJ(value));
+}
+
+void markTable(Table* t);
 void markValue(Value val);
 void freeObjects();
 void gc();
+#ifdef PARALLEL_MARK
+void freeMarkers();
+#endif
 #endif
\ No newline at end of file
@@ -1,18 +1,30 @@
 #include "object.h"
 #include "commons.h"
+#include "hash.h"
 #include "mem.h"
 #include "table.h"
 #include "vm.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #define ALLOCATE_OBJ(type, otype) ((type *)allocateObject(sizeof(type), otype))
 
+// Objects made while marking start grey, so the cycle traces whatever they
+// end up pointing at.
+static void linkObject(Obj *object) {
+	setObjNext(object, vm.objects);
+	vm.objects = object;
+	if (vm.gcPhase == GC_MARKING)
+		markObject(object);
+}
+
 static Obj *allocateObject(size_t size, ObjType type) {
 	Obj *object = (Obj *)reallocate(NULL, 0, size);
 	object->type = type;
-	object->next = vm.objects;
 	object->isMarked = false;
-	vm.objects = object;
+	object->isOld = false;
+	object->isRemembered = false;
+	linkObject(object);
 
 #ifdef DEBUG_LOGGC
 	printf("allocated %I64u bytes for %u at %p\n", size, type, (void *)object);
@@ -20,37 +32,50 @@ static Obj *allocateObject(size_t size, ObjType type) {
 	return object;
 }
 
-static ObjString *allocateString(const char *start, size_t length,
-								 uint32_t hash) {
-	ObjString *str = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-	str->chars = (char *)start;
-	str->length = length;
-	str->hash = hash;
+static void internString(ObjString *str) {
 	push(OBJ_VALUE((Obj *)str));
 	tableSet(&vm.strings, str, NULL_VALUE);
 	pop();
-	return str;
 }
 
 static uint32_t hashString(const char *key, int length) {
-	uint32_t hash = 2166136261u;
+	return hashBytes(key, length, HASH_SEED);
+}
 
-	for (int i = 0; i < length; i++) {
-		hash ^= key[i];
-		hash *= 16777619;
-	}
+// A string for the caller to fill in before passing it to takeString. Until
+// then the GC doesn't know about it.
+ObjString *newStringBuffer(size_t length) {
+	ObjString *str = (ObjString *)reallocate(NULL, 0, STRING_SIZE(length));
+	str->obj.type = OBJ_STRING;
+	str->obj.isMarked = false;
+	str->obj.isOld = false;
+	str->obj.isRemembered = false;
+	str->length = length;
+	str->chars[length] = 0;
+	return str;
+}
 
-	return hash;
+// Hands a filled in buffer to the GC without interning it. Its hash is worked
+// out by stringHash if something asks for it.
+ObjString *finishString(ObjString *buffer) {
+	buffer->hash = 0;
+	linkObject(&buffer->obj);
+	return buffer;
 }
 
-ObjString *takeString(const char *start, size_t length) {
-	uint32_t hash = hashString(start, length);
-	ObjString *interned = findTableString(&vm.strings, start, length, hash);
+// Interns a filled in buffer, freeing it if an equal string already exists.
+ObjString *takeString(ObjString *buffer) {
+	uint32_t hash = hashString(buffer->chars, buffer->length);
+	ObjString *interned =
+		findTableString(&vm.strings, buffer->chars, buffer->length, hash);
 	if (interned != NULL) {
-		FREE_ARRAY(char, (char *)start, length + 1);
+		reallocate(buffer, STRING_SIZE(buffer->length), 0);
 		return interned;
 	}
-	return allocateString(start, length, hash);
+	buffer->hash = hash;
+	linkObject(&buffer->obj);
+	internString(buffer);
+	return buffer;
 }
 
 ObjString *copyString(const char *start, size_t length) {
@@ -58,11 +83,125 @@ ObjString *copyString(const char *start, size_t length) {
 	ObjString *interned = findTableString(&vm.strings, start, length, hash);
 	if (interned != NULL)
 		return interned;
-	char *heapChars = ALLOCATE(char, length + 1);
-	memcpy(heapChars, start, length);
-	heapChars[length] = 0;
+	ObjString *str =
+		(ObjString *)allocateObject(STRING_SIZE(length), OBJ_STRING);
+	str->length = length;
+	str->hash = hash;
+	memcpy(str->chars, start, length);
+	str->chars[length] = 0;
+	internString(str);
+	return str;
+}
+
+// Like copyString, for strings made while running. Those are compared by
+// content rather than identity and never become table keys, so they aren't
+// worth hashing and interning.
+ObjString *makeString(const char *start, size_t length) {
+	ObjString *str = newStringBuffer(length);
+	memcpy(str->chars, start, length);
+	return finishString(str);
+}
+
+// Interned strings are hashed up front, others the first time this is called.
+uint32_t stringHash(ObjString *str) {
+	if (str->hash == 0)
+		str->hash = hashString(str->chars, str->length);
+	return str->hash;
+}
+
+bool stringsEqual(ObjString *a, ObjString *b) {
+	return a == b ||
+		   (a->length == b->length && stringHash(a) == stringHash(b) &&
+			memcmp(a->chars, b->chars, a->length) == 0);
+}
+
+// Flattened ropes are replaced by their string so the new rope doesn't keep
+// their halves alive.
+static Obj *ropeChild(Value x) {
+	if (IS_ROPE(x) && AS_ROPE(x)->flat != NULL)
+		return (Obj *)AS_ROPE(x)->flat;
+	return AS_OBJ(x);
+}
+
+// Joins two pieces of text. Both must be reachable by the GC. Results shorter
+// than ROPE_MIN_LENGTH are copied straight away; they can't contain a rope
+// since ropes are never that short.
+Value concatenate(Value a, Value b) {
+	if (textLength(a) == 0)
+		return b;
+	if (textLength(b) == 0)
+		return a;
+	int length = textLength(a) + textLength(b);
+	if (length < ROPE_MIN_LENGTH) {
+		ObjString *str1 = AS_STRING(a);
+		ObjString *str2 = AS_STRING(b);
+		ObjString *str = newStringBuffer(length);
+		memcpy(str->chars, str1->chars, str1->length);
+		memcpy(str->chars + str1->length, str2->chars, str2->length);
+		return OBJ_VALUE((Obj *)finishString(str));
+	}
+	ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+	rope->length = length;
+	rope->left = ropeChild(a);
+	rope->right = ropeChild(b);
+	rope->flat = NULL;
+	return OBJ_VALUE((Obj *)rope);
+}
 
-	return allocateString(heapChars, length, hash);
+// Calls visit on the strings making up a rope, from left to right. Ropes built
+// by appending in a loop are as deep as they are long, so this keeps its own
+// stack instead of recursing.
+static void walkRope(ObjRope *rope, void (*visit)(ObjString *, void *),
+					 void *data) {
+	Obj **pending = NULL;
+	int count = 0;
+	int capacity = 0;
+	Obj *node = (Obj *)rope;
+	for (;;) {
+		if (node->type == OBJ_ROPE && ((ObjRope *)node)->flat != NULL)
+			node = (Obj *)((ObjRope *)node)->flat;
+		if (node->type == OBJ_ROPE) {
+			if (count == capacity) {
+				capacity = GROW_CAPACITY(capacity);
+				pending = realloc(pending, capacity * sizeof(Obj *));
+				if (pending == NULL)
+					exit(1);
+			}
+			pending[count++] = ((ObjRope *)node)->right;
+			node = ((ObjRope *)node)->left;
+			continue;
+		}
+		visit((ObjString *)node, data);
+		if (count == 0)
+			break;
+		node = pending[--count];
+	}
+	free(pending);
+}
+
+static void appendPiece(ObjString *piece, void *data) {
+	char **end = data;
+	memcpy(*end, piece->chars, piece->length);
+	*end += piece->length;
+}
+
+static void printPiece(ObjString *piece, void *data) {
+	(void)data;
+	fwrite(piece->chars, 1, piece->length, stdout);
+}
+
+// Copies the rope's text into a string. The rope must be reachable by the GC.
+ObjString *flattenRope(ObjRope *rope) {
+	if (rope->flat != NULL)
+		return rope->flat;
+	ObjString *buffer = newStringBuffer(rope->length);
+	char *end = buffer->chars;
+	walkRope(rope, appendPiece, &end);
+	rope->flat = finishString(buffer);
+	rope->left = NULL;
+	rope->right = NULL;
+	writeBarrier(&rope->obj, &rope->flat->obj);
+	return rope->flat;
 }
 
 static void printFunction(ObjFunction *x) {
@@ -109,6 +248,14 @@ void printObject(Value val) {
 		printFunction(AS_METHOD(val)->closure->func);
 		break;
 	}
+	case OBJ_SHAPE: {
+		printf("<shape>");
+		break;
+	}
+	case OBJ_ROPE: {
+		walkRope(AS_ROPE(val), printPiece, NULL);
+		break;
+	}
 	default:
 		break;
 	}
@@ -117,6 +264,7 @@ void printObject(Value val) {
 ObjFunction *newFunction(NativeFn func) {
 	ObjFunction *e = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
 	e->arity = 0;
+	e->maxStack = 0;
 	e->name = NULL;
 	e->upvalueCount = 0;
 	initChunk(&(e->chunk));
@@ -127,15 +275,20 @@ ObjNative *newNative(NativeFn func) {
 	nat->f = func;
 	return nat;
 }
-ObjClosure *newClosure(ObjFunction *func) {
-	ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, func->upvalueCount);
-	for (int i = 0; i < func->upvalueCount; i++) {
-		upvalues[i] = NULL;
-	}
-	ObjClosure *cls = (ObjClosure *)ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+ObjClosure *newClosure(ObjFunction *func, int cellCount) {
+	ObjClosure *cls = (ObjClosure *)allocateObject(
+		CLOSURE_SIZE(func->upvalueCount, cellCount), OBJ_CLOSURE);
 	cls->func = func;
-	cls->upvalues = upvalues;
 	cls->upvalueCount = func->upvalueCount;
+	for (int i = 0; i < func->upvalueCount; i++) {
+		cls->upvalues[i] = NULL;
+	}
+	cls->cells = (ObjUpvalue *)(cls->upvalues + func->upvalueCount);
+	cls->cellCount = cellCount;
+	for (int i = 0; i < cellCount; i++) {
+		cls->cells[i].location = &cls->cells[i].closed;
+		cls->cells[i].closed = NULL_VALUE;
+	}
 	return cls;
 }
 ObjUpvalue *newUpvalue(Value *slot) {
@@ -144,16 +297,36 @@ ObjUpvalue *newUpvalue(Value *slot) {
 	upvalue->closed = NULL_VALUE;
 	return upvalue;
 }
+static ObjShape *newShape(ObjShape *parent, ObjString *name) {
+	ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+	shape->parent = parent;
+	shape->name = name;
+	shape->fieldCount = parent != NULL ? parent->fieldCount + 1 : 0;
+	initTable(&shape->transitions);
+	return shape;
+}
 ObjClass *newClass(ObjString *name) {
 	ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
 	klass->name = name;
+	klass->shape = NULL;
+	klass->slotHint = 0;
 	initTable(&klass->methods);
+	push(OBJ_VALUE((Obj *)klass));
+	klass->shape = newShape(NULL, NULL);
+	writeBarrier(&klass->obj, &klass->shape->obj);
+	pop();
 	return klass;
 }
 ObjInstance *newInstance(ObjClass *klass) {
-	ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+	int slots = klass->slotHint;
+	ObjInstance *instance = (ObjInstance *)allocateObject(
+		sizeof(ObjInstance) + sizeof(Value) * slots, OBJ_INSTANCE);
 	instance->klass = klass;
-	initTable(&instance->fields);
+	instance->shape = klass->shape;
+	instance->fields = NULL;
+	instance->inlineCapacity = slots;
+	instance->capacity = slots;
+	instance->slots = instance->inlineSlots;
 	return instance;
 }
 ObjMethod *newMethod(Value parent, ObjClosure *function) {
@@ -162,3 +335,98 @@ ObjMethod *newMethod(Value parent, ObjClosure *function) {
 	method->closure = function;
 	return method;
 }
+
+int shapeLookup(ObjShape *shape, ObjString *name) {
+	for (; shape->name != NULL; shape = shape->parent) {
+		if (shape->name == name)
+			return shape->fieldCount - 1;
+	}
+	return -1;
+}
+
+// Returns NULL when adding the field should push the instance into
+// dictionary mode instead.
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name) {
+	Value next;
+	if (tableGet(&shape->transitions, name, &next))
+		return AS_SHAPE(next);
+	if (shape->fieldCount >= SHAPE_MAX_FIELDS ||
+		shape->transitions.count >= SHAPE_MAX_TRANSITIONS)
+		return NULL;
+
+	ObjShape *child = newShape(shape, name);
+	push(OBJ_VALUE((Obj *)child));
+	tableSet(&shape->transitions, name, OBJ_VALUE((Obj *)child));
+	writeBarrier(&shape->obj, &child->obj);
+	pop();
+	return child;
+}
+
+void ensureSlots(ObjInstance *instance, int count) {
+	if (count <= instance->capacity)
+		return;
+	int capacity = GROW_CAPACITY(instance->capacity);
+	Value *slots = ALLOCATE(Value, capacity);
+	for (int i = 0; i < instance->shape->fieldCount; i++) {
+		slots[i] = instance->slots[i];
+	}
+	if (instance->slots != instance->inlineSlots)
+		FREE_ARRAY(Value, instance->slots, instance->capacity);
+	instance->slots = slots;
+	instance->capacity = capacity;
+}
+
+static void toDictionary(ObjInstance *instance) {
+	Table *fields = ALLOCATE(Table, 1);
+	initTable(fields);
+	for (ObjShape *s = instance->shape; s->name != NULL; s = s->parent) {
+		Value value = instance->slots[s->fieldCount - 1];
+		tableSet(fields, s->name, value);
+		writeBarrier(&instance->obj, &s->name->obj);
+		writeBarrierValue(&instance->obj, value);
+	}
+	if (instance->slots != instance->inlineSlots)
+		FREE_ARRAY(Value, instance->slots, instance->capacity);
+	instance->slots = instance->inlineSlots;
+	instance->capacity = instance->inlineCapacity;
+	instance->fields = fields;
+	instance->shape = NULL;
+}
+
+bool getField(ObjInstance *instance, ObjString *name, Value *value) {
+	if (instance->shape == NULL)
+		return tableGet(instance->fields, name, value);
+	int slot = shapeLookup(instance->shape, name);
+	if (slot == -1)
+		return false;
+	*value = instance->slots[slot];
+	return true;
+}
+
+// Returns true if the field did not exist before.
+bool setField(ObjInstance *instance, ObjString *name, Value value) {
+	if (instance->shape != NULL) {
+		int slot = shapeLookup(instance->shape, name);
+		if (slot != -1) {
+			instance->slots[slot] = value;
+			writeBarrierValue(&instance->obj, value);
+			return false;
+		}
+		ObjShape *next = shapeTransition(instance->shape, name);
+		if (next != NULL) {
+			ensureSlots(instance, next->fieldCount);
+			instance->slots[next->fieldCount - 1] = value;
+			instance->shape = next;
+			writeBarrierValue(&instance->obj, value);
+			writeBarrier(&instance->obj, &next->obj);
+			if (next->fieldCount > instance->klass->slotHint)
+				instance->klass->slotHint = next->fieldCount;
+			return true;
+		}
+		toDictionary(instance);
+	}
+	bool isNew = tableSet(instance->fields, name, value);
+	writeBarrier(&instance->obj, &name->obj);
+	writeBarrierValue(&instance->obj, value);
+	return isNew;
+}
\ No newline at end of file
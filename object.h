@@ -17,6 +17,8 @@
 #define AS_CLASS(x) ((ObjClass *)AS_OBJ(x))
 #define AS_INSTANCE(x) ((ObjInstance *)AS_OBJ(x))
 #define AS_METHOD(x) ((ObjMethod *)AS_OBJ(x))
+#define AS_SHAPE(x) ((ObjShape *)AS_OBJ(x))
+#define AS_ROPE(x) ((ObjRope *)AS_OBJ(x))
 
 #define IS_STRING(x) (isObjType(x, OBJ_STRING))
 #define IS_FUNCTION(x) (isObjType(x, OBJ_FUNCTION))
@@ -26,6 +28,16 @@
 #define IS_CLASS(x) (isObjType(x, OBJ_CLASS))
 #define IS_INSTANCE(x) (isObjType(x, OBJ_INSTANCE))
 #define IS_METHOD(x) (isObjType(x, OBJ_METHOD))
+#define IS_SHAPE(x) (isObjType(x, OBJ_SHAPE))
+#define IS_ROPE(x) (isObjType(x, OBJ_ROPE))
+
+// Instances switch to a field table instead of a shape once they have more
+// fields than this, or once a shape has this many different successors.
+#define SHAPE_MAX_FIELDS 32
+#define SHAPE_MAX_TRANSITIONS 16
+// Concatenations shorter than this are copied right away, longer ones build a
+// rope.
+#define ROPE_MIN_LENGTH 64
 
 typedef enum {
 	OBJ_STRING,
@@ -35,18 +47,36 @@ typedef enum {
 	OBJ_UPV,
 	OBJ_CLASS,
 	OBJ_INSTANCE,
-	OBJ_METHOD
+	OBJ_METHOD,
+	OBJ_SHAPE,
+	OBJ_ROPE
 } ObjType;
 
+// One word per object. next is the address of the following object in
+// vm.objects, which fits in the 48 bits user space addresses use on the
+// 64-bit targets we run on, as NaN boxing already assumes.
 struct sObj {
-	ObjType type;
-	struct sObj *next;
-	bool isMarked;
+	uint64_t next : 48;
+	uint64_t type : 8;
+	uint64_t isMarked : 1;
+	// Survived a collection. Minor collections only free objects that
+	// haven't.
+	uint64_t isOld : 1;
+	// In vm.remembered.
+	uint64_t isRemembered : 1;
 };
 
+static inline Obj *objNext(Obj *obj) { return (Obj *)(uintptr_t)obj->next; }
+
+static inline void setObjNext(Obj *obj, Obj *next) {
+	obj->next = (uintptr_t)next;
+}
+
 typedef struct {
 	Obj obj;
 	int arity;
+	// Most stack slots a call uses, counting the callee and arguments.
+	int maxStack;
 	Chunk chunk;
 	ObjString *name;
 	int upvalueCount;
@@ -62,8 +92,9 @@ typedef struct {
 struct sObjString {
 	Obj obj;
 	int length;
-	char *chars;
+	// 0 until stringHash works it out, interned strings are hashed up front.
 	uint32_t hash;
+	char chars[];
 };
 
 typedef struct sUpvalue {
@@ -76,20 +107,62 @@ typedef struct sUpvalue {
 typedef struct {
 	Obj obj;
 	ObjFunction *func;
-	ObjUpvalue **upvalues;
 	int upvalueCount;
+	int cellCount;
+	// Upvalues copied by value, stored after the upvalue pointers. They are
+	// not objects of their own.
+	ObjUpvalue *cells;
+	ObjUpvalue *upvalues[];
 } ObjClosure;
 
+// A string concatenation that hasn't been copied yet. left and right are
+// strings or ropes. Flattening caches the result in flat and drops them.
 typedef struct {
+	Obj obj;
+	int length;
+	Obj *left;
+	Obj *right;
+	ObjString *flat;
+} ObjRope;
+
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1)
+#define CLOSURE_SIZE(upvalueCount, cellCount)                                  \
+	(sizeof(ObjClosure) + sizeof(ObjUpvalue *) * (upvalueCount) +              \
+	 sizeof(ObjUpvalue) * (cellCount))
+
+// Hidden class of an instance: the ordered list of its field names. Each
+// shape adds one field to its parent and maps it to slot fieldCount - 1.
+// Instances of a class that add the same fields in the same order end up
+// sharing a shape.
+struct sObjShape {
+	Obj obj;
+	struct sObjShape *parent;
+	ObjString *name;
+	int fieldCount;
+	Table transitions;
+};
+
+struct sObjClass {
 	Obj obj;
 	ObjString *name;
 	Table methods;
-} ObjClass;
+	ObjShape *shape;
+	// Number of slots allocated inline in new instances, the most fields any
+	// instance of the class has had so far.
+	int slotHint;
+};
 
 typedef struct {
 	Obj obj;
 	ObjClass *klass;
-	Table fields;
+	// NULL once the instance is in dictionary mode and keeps its fields in
+	// the table instead.
+	ObjShape *shape;
+	Table *fields;
+	int inlineCapacity;
+	int capacity;
+	Value *slots;
+	Value inlineSlots[];
 } ObjInstance;
 
 typedef struct {
@@ -98,21 +171,44 @@ typedef struct {
 	ObjClosure *closure;
 } ObjMethod;
 
-ObjString *copyString(const char *start, size_t length);
+static inline bool isClosureCell(ObjClosure *closure, ObjUpvalue *upvalue) {
+	return upvalue >= closure->cells &&
+		   upvalue < closure->cells + closure->cellCount;
+}
 
 static inline bool isObjType(Value x, ObjType type) {
 	return IS_OBJ(x) && AS_OBJ(x)->type == type;
 }
+
+// Strings and ropes are both text to the language.
+static inline bool isText(Value x) { return IS_STRING(x) || IS_ROPE(x); }
+
+static inline int textLength(Value x) {
+	return IS_ROPE(x) ? AS_ROPE(x)->length : AS_STRING(x)->length;
+}
 ObjString *copyString(const char *start, size_t length);
-ObjString *takeString(const char *start, size_t length);
+ObjString *newStringBuffer(size_t length);
+ObjString *takeString(ObjString *buffer);
+ObjString *finishString(ObjString *buffer);
+ObjString *makeString(const char *start, size_t length);
+uint32_t stringHash(ObjString *str);
+bool stringsEqual(ObjString *a, ObjString *b);
+Value concatenate(Value a, Value b);
+ObjString *flattenRope(ObjRope *rope);
 
 void printObject(Value val);
 
 ObjFunction *newFunction();
 ObjNative *newNative(NativeFn func);
-ObjClosure *newClosure(ObjFunction *func);
+ObjClosure *newClosure(ObjFunction *func, int cellCount);
 ObjUpvalue *newUpvalue(Value *slot);
 ObjClass *newClass(ObjString *name);
 ObjInstance *newInstance(ObjClass *klass);
 ObjMethod *newMethod(Value parent, ObjClosure *function);
+
+int shapeLookup(ObjShape *shape, ObjString *name);
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+bool getField(ObjInstance *instance, ObjString *name, Value *value);
+bool setField(ObjInstance *instance, ObjString *name, Value value);
+void ensureSlots(ObjInstance *instance, int count);
 #endif
\ No newline at end of file
@@ -0,0 +1,420 @@
+#include "optimizer.h"
+#include "mem.h"
+#include <stdlib.h>
+
+bool optimizeBytecode = true;
+
+// A decoded instruction. Jumps point at instruction indices instead of byte
+// offsets so that instructions can be dropped without re-encoding anything
+// until the very end. A superinstruction carries its own operand bytes.
+typedef struct {
+	int offset;
+	int length;
+	uint8_t op;
+	int pops;
+	int target;
+	bool dead;
+	bool fused;
+	int operandCount;
+	uint8_t operands[5];
+} Instruction;
+
+static bool isJump(uint8_t op) {
+	switch (op) {
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_LOOP:
+	case OP_LESS_JUMP_IF_FALSE:
+	case OP_LESS_EQUAL_JUMP_IF_FALSE:
+	case OP_GREATER_JUMP_IF_FALSE:
+	case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+	case OP_POP_LOOP:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool isForwardJump(uint8_t op) {
+	return op != OP_JUMP && op != OP_LOOP && op != OP_POP_LOOP;
+}
+
+// The OP_JUMP_IF_FALSE form of a comparison, or 0 if there is none.
+static uint8_t compareJump(uint8_t op) {
+	switch (op) {
+	case OP_LESS:
+		return OP_LESS_JUMP_IF_FALSE;
+	case OP_LESS_EQUAL:
+		return OP_LESS_EQUAL_JUMP_IF_FALSE;
+	case OP_GREATER:
+		return OP_GREATER_JUMP_IF_FALSE;
+	case OP_GREATER_EQUAL:
+		return OP_GREATER_EQUAL_JUMP_IF_FALSE;
+	default:
+		return 0;
+	}
+}
+
+// Instructions that push one value and have no other effect.
+static bool isPurePush(uint8_t op) {
+	switch (op) {
+	case OP_CONSTANT:
+	case OP_CONSTANT_LONG:
+	case OP_NULL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_GET_LOCAL:
+	case OP_GET_UPV:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Index count stands for the end of the chunk and is never dead.
+static int nextLive(Instruction *ins, int count, int i) {
+	while (i < count && ins[i].dead)
+		i++;
+	return i;
+}
+
+static bool threadJumps(Instruction *ins, int count) {
+	bool changed = false;
+	for (int i = 0; i < count; i++) {
+		if (ins[i].dead || !isJump(ins[i].op))
+			continue;
+		bool conditional = ins[i].op == OP_JUMP_IF_FALSE;
+		int t = nextLive(ins, count, ins[i].target);
+		for (int hops = 0; hops < count && t < count; hops++) {
+			uint8_t op = ins[t].op;
+			// OP_JUMP_IF_FALSE leaves the condition on the stack, so one
+			// that jumped also takes a following OP_JUMP_IF_FALSE. It can
+			// only go forward, which rules out threading it into OP_LOOP.
+			if (op == OP_JUMP || (op == OP_LOOP && !conditional) ||
+				(op == OP_JUMP_IF_FALSE && conditional))
+				t = nextLive(ins, count, ins[t].target);
+			else
+				break;
+		}
+		if (t != ins[i].target) {
+			ins[i].target = t;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+static bool removeUnreachable(Instruction *ins, int count) {
+	bool *reached = calloc(count + 1, sizeof(bool));
+	int *work = malloc(sizeof(int) * (count + 1));
+	int workCount = 0;
+	work[workCount++] = 0;
+
+	while (workCount > 0) {
+		int i = work[--workCount];
+		while (true) {
+			i = nextLive(ins, count, i);
+			if (i >= count || reached[i])
+				break;
+			reached[i] = true;
+			uint8_t op = ins[i].op;
+			if (isJump(op))
+				work[workCount++] = ins[i].target;
+			if (op == OP_JUMP || op == OP_LOOP || op == OP_POP_LOOP ||
+				op == OP_RETURN || op == OP_TAIL_CALL || op == OP_TAIL_INVOKE)
+				break;
+			i++;
+		}
+	}
+
+	bool changed = false;
+	for (int i = 0; i < count; i++) {
+		if (!ins[i].dead && !reached[i]) {
+			ins[i].dead = true;
+			changed = true;
+		}
+	}
+	free(reached);
+	free(work);
+	return changed;
+}
+
+// Drops an instruction. Jumps to it now land on the next live one.
+static void kill(Instruction *ins, int count, int *jumpedTo, int i) {
+	ins[i].dead = true;
+	jumpedTo[nextLive(ins, count, i + 1)] += jumpedTo[i];
+	jumpedTo[i] = 0;
+}
+
+// Number of live jumps landing on each instruction.
+static int *countJumps(Instruction *ins, int count) {
+	int *jumpedTo = calloc(count + 1, sizeof(int));
+	for (int i = 0; i < count; i++) {
+		if (!ins[i].dead && isJump(ins[i].op))
+			jumpedTo[nextLive(ins, count, ins[i].target)]++;
+	}
+	return jumpedTo;
+}
+
+static bool peephole(Instruction *ins, int count) {
+	int *jumpedTo = countJumps(ins, count);
+
+	bool changed = false;
+	for (int i = 0; i < count; i++) {
+		if (ins[i].dead)
+			continue;
+		int next = nextLive(ins, count, i + 1);
+		uint8_t op = ins[i].op;
+
+		// A jump to the next instruction does nothing. OP_JUMP_IF_FALSE
+		// doesn't pop its condition, so that goes for it too.
+		if ((op == OP_JUMP || op == OP_JUMP_IF_FALSE) &&
+			nextLive(ins, count, ins[i].target) == next) {
+			jumpedTo[next]--;
+			kill(ins, count, jumpedTo, i);
+			changed = true;
+			continue;
+		}
+		if (next >= count || jumpedTo[next] != 0)
+			continue;
+
+		if (isPurePush(op) && ins[next].op == OP_POP) {
+			kill(ins, count, jumpedTo, i);
+			kill(ins, count, jumpedTo, next);
+			changed = true;
+		} else if ((op == OP_POP || op == OP_POPN) && jumpedTo[i] == 0 &&
+				   (ins[next].op == OP_POP || ins[next].op == OP_POPN) &&
+				   ins[i].pops + ins[next].pops <= UINT8_MAX) {
+			ins[i].op = OP_POPN;
+			ins[i].pops += ins[next].pops;
+			kill(ins, count, jumpedTo, next);
+			changed = true;
+			i--;
+		}
+	}
+	free(jumpedTo);
+	return changed;
+}
+
+static void fuseOperands(Instruction *in, uint8_t op, uint8_t *operands,
+						 int count) {
+	in->op = op;
+	in->fused = true;
+	in->operandCount = count;
+	for (int i = 0; i < count; i++)
+		in->operands[i] = operands[i];
+}
+
+// Replaces hot instruction sequences with superinstructions. Nothing but the
+// first instruction of a sequence may be a jump target.
+static void fuse(Chunk *chunk, Instruction *ins, int count) {
+	int *jumpedTo = countJumps(ins, count);
+	uint8_t *code = chunk->code;
+
+	for (int i = 0; i < count; i++) {
+		if (ins[i].dead)
+			continue;
+		int a = nextLive(ins, count, i + 1);
+		if (a >= count || jumpedTo[a] != 0)
+			continue;
+		int b = nextLive(ins, count, a + 1);
+		bool bFree = b < count && jumpedTo[b] == 0;
+		uint8_t *operandsI = &code[ins[i].offset + 1];
+		uint8_t *operandsA = &code[ins[a].offset + 1];
+
+		switch (ins[i].op) {
+		case OP_GET_LOCAL:
+			if (ins[a].op == OP_CONSTANT && bFree && ins[b].op == OP_ADD) {
+				uint8_t operands[] = {operandsI[0], operandsA[0]};
+				fuseOperands(&ins[i], OP_ADD_LOCAL_CONST, operands, 2);
+				kill(ins, count, jumpedTo, a);
+				kill(ins, count, jumpedTo, b);
+			} else if (ins[a].op == OP_GET_FIELD && operandsI[0] == 0) {
+				fuseOperands(&ins[i], OP_GET_THIS_FIELD, operandsA, 5);
+				kill(ins, count, jumpedTo, a);
+			} else if (ins[a].op == OP_GET_LOCAL) {
+				uint8_t operands[] = {operandsI[0], operandsA[0]};
+				fuseOperands(&ins[i], OP_GET_LOCAL_LOCAL, operands, 2);
+				kill(ins, count, jumpedTo, a);
+			}
+			break;
+		case OP_LESS:
+		case OP_LESS_EQUAL:
+		case OP_GREATER:
+		case OP_GREATER_EQUAL: {
+			if (ins[a].op != OP_JUMP_IF_FALSE || !bFree || ins[b].op != OP_POP)
+				break;
+			int t = nextLive(ins, count, ins[a].target);
+			if (t >= count || ins[t].op != OP_POP)
+				break;
+			// The false path skips the OP_POP at the target, which keeps it
+			// from being fused into something else.
+			ins[i].target = t + 1;
+			jumpedTo[nextLive(ins, count, t + 1)]++;
+			fuseOperands(&ins[i], compareJump(ins[i].op), NULL, 0);
+			kill(ins, count, jumpedTo, a);
+			kill(ins, count, jumpedTo, b);
+			break;
+		}
+		case OP_POP:
+			if (ins[a].op == OP_LOOP && ins[a].target <= i) {
+				ins[i].target = ins[a].target;
+				fuseOperands(&ins[i], OP_POP_LOOP, NULL, 0);
+				kill(ins, count, jumpedTo, a);
+			}
+			break;
+		default:;
+		}
+	}
+	free(jumpedTo);
+}
+
+static int encodedLength(Instruction *in) {
+	if (isJump(in->op))
+		return 3;
+	if (in->fused)
+		return 1 + in->operandCount;
+	if (in->op == OP_POPN)
+		return in->pops == 1 ? 1 : 2;
+	return in->length;
+}
+
+static void emitShort(Chunk *chunk, int value, int line) {
+	writeChunk(chunk, (value >> 8) & 0xff, line);
+	writeChunk(chunk, value & 0xff, line);
+}
+
+// Writes the surviving instructions back into the chunk. Returns false and
+// leaves the chunk alone if a jump no longer fits its encoding.
+static bool reassemble(Chunk *chunk, Instruction *ins, int count) {
+	int *newOffset = malloc(sizeof(int) * (count + 1));
+	int size = 0;
+	for (int i = 0; i < count; i++) {
+		newOffset[i] = size;
+		if (!ins[i].dead)
+			size += encodedLength(&ins[i]);
+	}
+	newOffset[count] = size;
+
+	for (int i = 0; i < count; i++) {
+		if (ins[i].dead || !isJump(ins[i].op))
+			continue;
+		uint8_t op = ins[i].op;
+		int distance = newOffset[ins[i].target] - (newOffset[i] + 3);
+		if ((isForwardJump(op) && distance < 0) ||
+			(op == OP_POP_LOOP && distance > 0) ||
+			abs(distance) > UINT16_MAX) {
+			free(newOffset);
+			return false;
+		}
+	}
+
+	Chunk old = *chunk;
+	uint8_t *code = old.code;
+	chunk->code = NULL;
+	chunk->count = 0;
+	chunk->capacity = 0;
+	chunk->lines = NULL;
+	chunk->lineCount = 0;
+	chunk->lineCapacity = 0;
+
+	for (int i = 0; i < count; i++) {
+		Instruction *in = &ins[i];
+		if (in->dead)
+			continue;
+		int line = getLine(&old, in->offset);
+		if (isJump(in->op)) {
+			int distance = newOffset[in->target] - (newOffset[i] + 3);
+			if (isForwardJump(in->op)) {
+				writeChunk(chunk, in->op, line);
+			} else if (in->op == OP_POP_LOOP) {
+				writeChunk(chunk, OP_POP_LOOP, line);
+				distance = -distance;
+			} else if (distance >= 0) {
+				writeChunk(chunk, OP_JUMP, line);
+			} else {
+				writeChunk(chunk, OP_LOOP, line);
+				distance = -distance;
+			}
+			emitShort(chunk, distance, line);
+		} else if (in->fused) {
+			writeChunk(chunk, in->op, line);
+			for (int b = 0; b < in->operandCount; b++)
+				writeChunk(chunk, in->operands[b], line);
+		} else if (in->op == OP_POPN) {
+			if (in->pops == 1) {
+				writeChunk(chunk, OP_POP, line);
+			} else {
+				writeChunk(chunk, OP_POPN, line);
+				writeChunk(chunk, in->pops, line);
+			}
+		} else {
+			for (int b = 0; b < in->length; b++)
+				writeChunk(chunk, code[in->offset + b], line);
+		}
+	}
+
+	FREE_ARRAY(uint8_t, code, old.capacity);
+	FREE_ARRAY(LineStart, old.lines, old.lineCapacity);
+	free(newOffset);
+	return true;
+}
+
+// Jump threading, unreachable code removal and a few peephole rewrites over
+// a finished chunk, repeated until nothing changes. Superinstructions are
+// picked last.
+void optimizeChunk(Chunk *chunk) {
+	int count = 0;
+	for (int o = 0; o < chunk->count; o += instructionLength(chunk, o))
+		count++;
+
+	Instruction *ins = malloc(sizeof(Instruction) * count);
+	int *indexOf = malloc(sizeof(int) * (chunk->count + 1));
+	for (int o = 0; o <= chunk->count; o++)
+		indexOf[o] = -1;
+
+	for (int i = 0, o = 0; i < count; i++) {
+		ins[i].offset = o;
+		ins[i].length = instructionLength(chunk, o);
+		ins[i].op = chunk->code[o];
+		ins[i].pops = 0;
+		if (ins[i].op == OP_POP)
+			ins[i].pops = 1;
+		else if (ins[i].op == OP_POPN)
+			ins[i].pops = chunk->code[o + 1];
+		ins[i].dead = false;
+		ins[i].fused = false;
+		indexOf[o] = i;
+		o += ins[i].length;
+	}
+	indexOf[chunk->count] = count;
+
+	bool valid = true;
+	for (int i = 0; i < count; i++) {
+		if (!isJump(ins[i].op))
+			continue;
+		int o = ins[i].offset;
+		int distance = (chunk->code[o + 1] << 8) | chunk->code[o + 2];
+		int target = ins[i].op == OP_LOOP ? o + 3 - distance : o + 3 + distance;
+		if (target < 0 || target > chunk->count || indexOf[target] == -1) {
+			valid = false;
+			break;
+		}
+		ins[i].target = indexOf[target];
+	}
+
+	if (valid) {
+		bool changed = true;
+		while (changed) {
+			changed = threadJumps(ins, count);
+			changed |= removeUnreachable(ins, count);
+			changed |= peephole(ins, count);
+		}
+		fuse(chunk, ins, count);
+		removeUnreachable(ins, count);
+		reassemble(chunk, ins, count);
+	}
+
+	free(ins);
+	free(indexOf);
+}
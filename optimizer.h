@@ -0,0 +1,11 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "chunk.h"
+#include "commons.h"
+
+// Cleared by the -O0 command line flag.
+extern bool optimizeBytecode;
+
+void optimizeChunk(Chunk *chunk);
+#endif
@@ -97,7 +97,15 @@ static TokenType identifierType() {
 	case 'b':
 		return checkKeyword(1, 4, "reak", TOKEN_BREAK);
 	case 'c':
-		return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+		if (scanner.current - scanner.start > 1) {
+			switch (scanner.start[1]) {
+			case 'l':
+				return checkKeyword(2, 3, "ass", TOKEN_CLASS);
+			case 'o':
+				return checkKeyword(2, 3, "nst", TOKEN_CONST);
+			}
+		}
+		break;
 	case 'e':
 		return checkKeyword(1, 3, "lse", TOKEN_ELSE);
 	case 'i':
@@ -178,8 +186,12 @@ Token scanToken() {
 	case '=':
 		return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
 	case '<':
+		if (match('<'))
+			return makeToken(TOKEN_LESS_LESS);
 		return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
 	case '>':
+		if (match('>'))
+			return makeToken(TOKEN_GREATER_GREATER);
 		return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
 	case '%':
 		return makeToken(TOKEN_MODULO);
@@ -187,6 +199,16 @@ Token scanToken() {
 		return makeToken(TOKEN_LEFT_BRACKET);
 	case ']':
 		return makeToken(TOKEN_RIGHT_BRACKET);
+	case '&':
+		return makeToken(TOKEN_AMPERSAND);
+	case '|':
+		return makeToken(TOKEN_PIPE);
+	case '^':
+		return makeToken(TOKEN_CARET);
+	case '~':
+		return makeToken(TOKEN_TILDE);
+	case '\\':
+		return makeToken(TOKEN_BACKSLASH);
 	case '"': {
 		while (!isAtEnd() && peek() != '"') {
 			if (peek() == '\n')
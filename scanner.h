@@ -19,6 +19,11 @@ typedef enum {
 	TOKEN_MODULO,
 	TOKEN_LEFT_BRACKET,
 	TOKEN_RIGHT_BRACKET,
+	TOKEN_AMPERSAND,
+	TOKEN_PIPE,
+	TOKEN_CARET,
+	TOKEN_TILDE,
+	TOKEN_BACKSLASH,
 
 	// One or two character tokens.
 	TOKEN_BANG,
@@ -29,6 +34,8 @@ typedef enum {
 	TOKEN_GREATER_EQUAL,
 	TOKEN_LESS,
 	TOKEN_LESS_EQUAL,
+	TOKEN_GREATER_GREATER,
+	TOKEN_LESS_LESS,
 
 	// Literals.
 	TOKEN_IDENTIFIER,
@@ -39,6 +46,7 @@ typedef enum {
 	TOKEN_AND,
 	TOKEN_BREAK,
 	TOKEN_CLASS,
+	TOKEN_CONST,
 	TOKEN_ELSE,
 	TOKEN_FALSE,
 	TOKEN_FOR,
@@ -6,72 +6,167 @@
 #include "table.h"
 #include "value.h"
 
+#ifdef SIMD_TABLE
+#include <emmintrin.h>
+#endif
+
+// Control bytes of full slots are the low 7 bits of the key's hash, so they
+// never have the top bit set.
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+
 void initTable(Table *t) {
 	t->capacity = 0;
 	t->count = 0;
+	t->growthLeft = 0;
 	t->entries = NULL;
 }
 
+static size_t tableSize(int capacity) {
+	return (sizeof(Entry) + 1) * (size_t)capacity;
+}
+
+static uint8_t *controlBytes(Entry *entries, int capacity) {
+	return (uint8_t *)(entries + capacity);
+}
+
 void freeTable(Table *t) {
-	FREE_ARRAY(Entry, t->entries, t->capacity);
+	reallocate(t->entries, tableSize(t->capacity), 0);
 	initTable(t);
 }
 
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
-	uint32_t index = key->hash % capacity;
-	Entry *tombstone = NULL;
-	while (true) {
-		Entry *entry = &entries[index];
-		if (entry->key == NULL) {
-			if (IS_NULL(entry->value)) {
-				return tombstone != NULL ? tombstone : entry;
-			} else {
-				if (tombstone == NULL)
-					tombstone = entry;
-			}
-		} else if (entry->key == key) {
-			return entry;
+// Bit i is set when the group's control byte i equals byte.
+static inline uint32_t matchByte(const uint8_t *group, uint8_t byte) {
+#ifdef SIMD_TABLE
+	__m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(byte)));
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < TABLE_GROUP; i++)
+		mask |= (uint32_t)(group[i] == byte) << i;
+	return mask;
+#endif
+}
+
+// Bit i is set when slot i is empty or deleted.
+static inline uint32_t matchFree(const uint8_t *group) {
+#ifdef SIMD_TABLE
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+	uint32_t mask = 0;
+	for (int i = 0; i < TABLE_GROUP; i++)
+		mask |= (uint32_t)(group[i] >> 7) << i;
+	return mask;
+#endif
+}
+
+static inline int lowestBit(uint32_t mask) {
+#ifdef __GNUC__
+	return __builtin_ctz(mask);
+#else
+	int i = 0;
+	while (!(mask & 1)) {
+		mask >>= 1;
+		i++;
+	}
+	return i;
+#endif
+}
+
+// The group a hash starts probing at. Later groups are visited at growing
+// strides, which reaches every group since their count is a power of two.
+static inline uint32_t firstGroup(uint32_t hash, int capacity) {
+	return (hash >> 7) & (capacity / TABLE_GROUP - 1);
+}
+
+static inline uint32_t nextGroup(uint32_t group, int *stride, int capacity) {
+	return (group + ++*stride) & (capacity / TABLE_GROUP - 1);
+}
+
+static Entry *findEntry(Table *t, ObjString *key) {
+	uint8_t *ctrl = controlBytes(t->entries, t->capacity);
+	uint8_t h2 = key->hash & 0x7f;
+	int stride = 0;
+	for (uint32_t g = firstGroup(key->hash, t->capacity);;
+		 g = nextGroup(g, &stride, t->capacity)) {
+		uint8_t *group = ctrl + g * TABLE_GROUP;
+		for (uint32_t m = matchByte(group, h2); m != 0; m &= m - 1) {
+			Entry *entry = &t->entries[g * TABLE_GROUP + lowestBit(m)];
+			if (entry->key == key)
+				return entry;
 		}
+		if (matchByte(group, CTRL_EMPTY))
+			return NULL;
+	}
+}
 
-		index = (index + 1) % capacity;
+// The first empty or deleted slot on the hash's probe sequence.
+static int findFree(uint8_t *ctrl, int capacity, uint32_t hash) {
+	int stride = 0;
+	for (uint32_t g = firstGroup(hash, capacity);;
+		 g = nextGroup(g, &stride, capacity)) {
+		uint32_t m = matchFree(ctrl + g * TABLE_GROUP);
+		if (m != 0)
+			return g * TABLE_GROUP + lowestBit(m);
 	}
 }
 
+// Rebuilds the table with the given capacity, which drops deleted slots.
 static void adjustCapacity(Table *t, int capacity) {
-	Entry *entries = ALLOCATE(Entry, capacity);
+	Entry *entries = reallocate(NULL, 0, tableSize(capacity));
+	uint8_t *ctrl = controlBytes(entries, capacity);
+	memset(ctrl, CTRL_EMPTY, capacity);
 	for (int i = 0; i < capacity; i++) {
 		entries[i].key = NULL;
 		entries[i].value = NULL_VALUE;
 	}
-	t->count = 0;
 	for (int i = 0; i < t->capacity; i++) {
 		Entry *entry = &t->entries[i];
 		if (entry->key == NULL)
 			continue;
-		Entry *dest = findEntry(entries, capacity, entry->key);
-		*dest = *entry;
-		t->count++;
+		int slot = findFree(ctrl, capacity, entry->key->hash);
+		ctrl[slot] = entry->key->hash & 0x7f;
+		entries[slot] = *entry;
 	}
-	FREE_ARRAY(Entry, t->entries, t->capacity);
+	reallocate(t->entries, tableSize(t->capacity), 0);
 	t->entries = entries;
 	t->capacity = capacity;
+	t->growthLeft = TABLE_MAX_LOAD(capacity) - t->count;
 }
 
 bool tableSet(Table *t, ObjString *key, Value value) {
-	if (t->count + 1 > t->capacity * TABLE_MAX_LOAD) {
-		int capacity = GROW_CAPACITY(t->capacity);
-		adjustCapacity(t, capacity);
+	if (t->count > 0) {
+		Entry *entry = findEntry(t, key);
+		if (entry != NULL) {
+			entry->value = value;
+			return false;
+		}
 	}
 
-	Entry *entry = findEntry(t->entries, t->capacity, key);
-	bool isNew = entry->key == NULL;
-	if (isNew && IS_NULL(entry->value))
-		t->count++;
+	if (t->capacity == 0)
+		adjustCapacity(t, TABLE_MIN_CAPACITY);
+	uint8_t *ctrl = controlBytes(t->entries, t->capacity);
+	int slot = findFree(ctrl, t->capacity, key->hash);
+	if (ctrl[slot] == CTRL_EMPTY && t->growthLeft == 0) {
+		// Out of empty slots. Grow unless deleted slots take up enough of
+		// the table that rebuilding it at the same size frees half of it.
+		int capacity = t->capacity;
+		if (t->count + 1 > TABLE_MAX_LOAD(capacity) / 2)
+			capacity *= 2;
+		adjustCapacity(t, capacity);
+		ctrl = controlBytes(t->entries, t->capacity);
+		slot = findFree(ctrl, t->capacity, key->hash);
+	}
 
-	entry->key = key;
-	entry->value = value;
-	return isNew;
+	if (ctrl[slot] == CTRL_EMPTY)
+		t->growthLeft--;
+	ctrl[slot] = key->hash & 0x7f;
+	t->entries[slot].key = key;
+	t->entries[slot].value = value;
+	t->count++;
+	return true;
 }
+
 void tableAddAll(Table *src, Table *dest) {
 	for (int i = 0; i < src->capacity; i++) {
 		Entry *entry = &src->entries[i];
@@ -85,8 +180,8 @@ bool tableGet(Table *t, ObjString *key, Value *value) {
 	if (t->count == 0)
 		return false;
 
-	Entry *e = findEntry(t->entries, t->capacity, key);
-	if (e->key != NULL) {
+	Entry *e = findEntry(t, key);
+	if (e != NULL) {
 		if (value != NULL)
 			*value = e->value;
 		return true;
@@ -94,22 +189,41 @@ bool tableGet(Table *t, ObjString *key, Value *value) {
 		return false;
 }
 
+// A slot in a group that still has an empty one can be made empty again:
+// probes stop at that group anyway, so none went past it looking for a key.
+static void removeSlot(Table *t, int slot) {
+	uint8_t *ctrl = controlBytes(t->entries, t->capacity);
+	uint8_t *group = ctrl + slot / TABLE_GROUP * TABLE_GROUP;
+	if (matchByte(group, CTRL_EMPTY)) {
+		ctrl[slot] = CTRL_EMPTY;
+		t->growthLeft++;
+	} else {
+		ctrl[slot] = CTRL_DELETED;
+	}
+	t->entries[slot].key = NULL;
+	t->entries[slot].value = NULL_VALUE;
+	t->count--;
+}
+
 bool tableRemove(Table *t, ObjString *key) {
 	if (t->count == 0)
 		return false;
-	Entry *entry = findEntry(t->entries, t->capacity, key);
-	if (entry->key == NULL)
+	Entry *entry = findEntry(t, key);
+	if (entry == NULL)
 		return false;
 
-	entry->key = NULL;
-	entry->value = BOOL_VALUE(true);
+	removeSlot(t, (int)(entry - t->entries));
 	return true;
 }
-void tableRemoveWhite(Table *table) {
+
+// Removes keys the collector is about to free. Minor collections don't mark
+// old objects, so only young keys are checked then.
+void tableRemoveWhite(Table *table, bool youngOnly) {
 	for (int i = 0; i < table->capacity; i++) {
 		Entry *e = &table->entries[i];
-		if (e->key != NULL && !e->key->obj.isMarked) {
-			tableRemove(table, e->key);
+		if (e->key != NULL && !e->key->obj.isMarked &&
+			!(youngOnly && e->key->obj.isOld)) {
+			removeSlot(table, i);
 		}
 	}
 }
@@ -119,17 +233,18 @@ ObjString *findTableString(Table *t, const char *start, int length,
 
 	if (t->count == 0)
 		return NULL;
-	uint32_t index = hash % t->capacity;
-	for (;;) {
-		Entry *entry = &t->entries[index];
-		if (entry->key == NULL) {
-			if (IS_NULL(entry->value))
-				return NULL;
-		} else if (entry->key->length == length && entry->key->hash == hash &&
-				   memcmp(entry->key->chars, start, length) == 0) {
-			return entry->key;
+	uint8_t *ctrl = controlBytes(t->entries, t->capacity);
+	int stride = 0;
+	for (uint32_t g = firstGroup(hash, t->capacity);;
+		 g = nextGroup(g, &stride, t->capacity)) {
+		uint8_t *group = ctrl + g * TABLE_GROUP;
+		for (uint32_t m = matchByte(group, hash & 0x7f); m != 0; m &= m - 1) {
+			ObjString *key = t->entries[g * TABLE_GROUP + lowestBit(m)].key;
+			if (key->length == length && key->hash == hash &&
+				memcmp(key->chars, start, length) == 0)
+				return key;
 		}
-
-		index = (index + 1) % t->capacity;
+		if (matchByte(group, CTRL_EMPTY))
+			return NULL;
 	}
 }
\ No newline at end of file
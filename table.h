@@ -4,28 +4,38 @@
 #include "commons.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+// Tables are split into groups of this many slots, each with a control byte
+// per slot saying whether it's empty, deleted or holds a key with some hash
+// bits. Lookups check a group's control bytes at once before touching any
+// entries.
+#define TABLE_GROUP 16
+#define TABLE_MIN_CAPACITY TABLE_GROUP
+// At most 3/4 of the slots are used, counting deleted ones.
+#define TABLE_MAX_LOAD(capacity) ((capacity) / 4 * 3)
 
 typedef struct {
 	ObjString *key;
 	Value value;
 } Entry;
 
+// capacity is 0 or a power of two. entries holds capacity entries followed by
+// capacity control bytes. Unused entries have a NULL key.
 typedef struct {
 	int count;
 	int capacity;
+	// Empty slots that can still be filled before the table is rebuilt.
+	int growthLeft;
 	Entry *entries;
 } Table;
 
 void initTable(Table *t);
 void freeTable(Table *t);
 bool tableSet(Table *t, ObjString *key, Value value);
-bool tableSet(Table *t, ObjString *key, Value value);
 void tableAddAll(Table *src, Table *dest);
 bool tableGet(Table *t, ObjString *key, Value *value);
 bool tableRemove(Table *t, ObjString *key);
 ObjString *findTableString(Table *t, const char *start, int length,
 						   uint32_t hash);
-void tableRemoveWhite(Table *table);
+void tableRemoveWhite(Table *table, bool youngOnly);
 
 #endif
\ No newline at end of file
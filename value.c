@@ -2,6 +2,7 @@
 #include "commons.h"
 #include "mem.h"
 #include "object.h"
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 void initValueArray(ValueArray *array) {
@@ -24,35 +25,92 @@ void freeValueArray(ValueArray *array) {
 	initValueArray(array);
 }
 void printValue(Value value) {
-	switch (value.type) {
-	case VAL_NUM:
-		printf("%g", AS_NUM(value));
-		break;
-	case VAL_BOOL:
+	if (IS_INT(value)) {
+		printf("%" PRId64, AS_INT(value));
+	} else if (IS_DOUBLE(value)) {
+		printf("%g", AS_DOUBLE(value));
+	} else if (IS_BOOL(value)) {
 		printf(AS_BOOL(value) ? "true" : "false");
-		break;
-	case VAL_NULL:
+	} else if (IS_NULL(value)) {
 		printf("NULL");
-		break;
-	case VAL_OBJ:
+	} else if (IS_OBJ(value)) {
 		printObject(value);
-		break;
 	}
 }
 
 bool equal(Value a, Value b) {
+#ifdef NAN_BOXING
+	if (IS_DOUBLE(a) || IS_DOUBLE(b))
+		return IS_NUM(a) && IS_NUM(b) && AS_NUM(a) == AS_NUM(b);
+	if (a == b)
+		return true;
+	return IS_STRING(a) && IS_STRING(b) &&
+		   stringsEqual(AS_STRING(a), AS_STRING(b));
+#else
+	if (IS_DOUBLE(a) != IS_DOUBLE(b))
+		return IS_NUM(a) && IS_NUM(b) && AS_NUM(a) == AS_NUM(b);
 	if (a.type != b.type)
 		return false;
 	switch (a.type) {
 	case VAL_BOOL:
 		return AS_BOOL(a) == AS_BOOL(b);
 	case VAL_NULL:
+	case VAL_UNDEFINED:
 		return true;
-	case VAL_NUM:
-		return AS_NUM(a) == AS_NUM(b);
+	case VAL_DOUBLE:
+		return AS_DOUBLE(a) == AS_DOUBLE(b);
+	case VAL_INT:
+		return AS_INT(a) == AS_INT(b);
 	case VAL_OBJ:
-		return AS_OBJ(a) == AS_OBJ(b);
+		if (AS_OBJ(a) == AS_OBJ(b))
+			return true;
+		return IS_STRING(a) && IS_STRING(b) &&
+			   stringsEqual(AS_STRING(a), AS_STRING(b));
 	default:
 		return false;
 	}
+#endif
 }
+
+
+// The bits that tell a value apart from others of its kind.
+static uint64_t valueBits(Value value) {
+#ifdef NAN_BOXING
+	return value;
+#else
+	switch (value.type) {
+	case VAL_BOOL:
+		return AS_BOOL(value);
+	case VAL_DOUBLE: {
+		double d = AS_DOUBLE(value);
+		uint64_t bits;
+		memcpy(&bits, &d, sizeof(bits));
+		return bits;
+	}
+	case VAL_INT:
+		return (uint64_t)AS_INT(value);
+	case VAL_OBJ:
+		return (uint64_t)(uintptr_t)AS_OBJ(value);
+	default:
+		return 0;
+	}
+#endif
+}
+
+// Unlike equal(), tells 1 from 1.0 and 0.0 from -0.0.
+bool identical(Value a, Value b) {
+#ifndef NAN_BOXING
+	if (a.type != b.type)
+		return false;
+#endif
+	return valueBits(a) == valueBits(b);
+}
+
+uint32_t hashValue(Value value) {
+	uint64_t bits = valueBits(value);
+#ifndef NAN_BOXING
+	bits ^= (uint64_t)value.type << 56;
+#endif
+	bits *= 0x9e3779b97f4a7c15u;
+	return (uint32_t)(bits >> 32);
+}
\ No newline at end of file
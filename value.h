@@ -3,18 +3,90 @@
 
 #include "commons.h"
 #include "math.h"
-#include "value.h"
+#include <string.h>
 
 typedef struct sObj Obj;
 typedef struct sObjString ObjString;
+typedef struct sObjClass ObjClass;
+typedef struct sObjShape ObjShape;
 
-typedef enum { VAL_NULL, VAL_BOOL, VAL_NUM, VAL_OBJ } ValueType;
+#ifdef NAN_BOXING
+
+// Doubles are stored as-is. Everything else lives in the payload of a quiet
+// NaN: the sign bit marks an object pointer, INT_TAG a 48-bit integer held in
+// the low bits, and otherwise the low bits tag the singletons.
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+#define INT_TAG ((uint64_t)0x0002000000000000)
+#define INT_MASK ((uint64_t)0x0000ffffffffffff)
+
+#define TAG_NULL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_UNDEFINED 4
+
+typedef uint64_t Value;
+
+typedef struct {
+	int count;
+	int capacity;
+	Value *values;
+} ValueArray;
+
+#define AS_BOOL(x) ((x) == TRUE_VALUE)
+#define AS_DOUBLE(x) valueToNum(x)
+#define AS_INT(x) ((int64_t)((x) << 16) >> 16)
+#define AS_OBJ(x) ((Obj *)(uintptr_t)((x) & ~(SIGN_BIT | QNAN)))
+
+#define IS_NULL(x) ((x) == NULL_VALUE)
+#define IS_DOUBLE(x) (((x)&QNAN) != QNAN)
+#define IS_INT(x) (((x) & (SIGN_BIT | QNAN | INT_TAG)) == (QNAN | INT_TAG))
+#define IS_BOOL(x) (((x) | 1) == TRUE_VALUE)
+#define IS_OBJ(x) (((x) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define TRUE_VALUE ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define FALSE_VALUE ((Value)(uint64_t)(QNAN | TAG_FALSE))
+
+#define BOOL_VALUE(x) ((x) ? TRUE_VALUE : FALSE_VALUE)
+#define NUM_VALUE(x) numToValue(x)
+#define INT_VALUE(x) ((Value)(QNAN | INT_TAG | ((uint64_t)(x)&INT_MASK)))
+#define OBJ_VALUE(x) ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(x)))
+#define NULL_VALUE ((Value)(uint64_t)(QNAN | TAG_NULL))
+#define UNDEFINED_VALUE ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+
+#define IS_UNDEFINED(x) ((x) == UNDEFINED_VALUE)
+
+#define INT_FITS(x) ((x) >= -((int64_t)1 << 47) && (x) < ((int64_t)1 << 47))
+
+static inline double valueToNum(Value value) {
+	double num;
+	memcpy(&num, &value, sizeof(Value));
+	return num;
+}
+
+static inline Value numToValue(double num) {
+	Value value;
+	memcpy(&value, &num, sizeof(double));
+	return value;
+}
+
+#else
+
+typedef enum {
+	VAL_NULL,
+	VAL_BOOL,
+	VAL_DOUBLE,
+	VAL_INT,
+	VAL_OBJ,
+	VAL_UNDEFINED
+} ValueType;
 
 typedef struct {
 	ValueType type;
 	union {
 		bool boolean;
 		double number;
+		int64_t integer;
 		Obj *obj;
 	} as;
 } Value;
@@ -26,26 +98,144 @@ typedef struct {
 } ValueArray;
 
 #define AS_BOOL(x) ((x).as.boolean)
-#define AS_NUM(x) ((x).as.number)
+#define AS_DOUBLE(x) ((x).as.number)
+#define AS_INT(x) ((x).as.integer)
 #define AS_OBJ(x) ((x).as.obj)
 
-
 #define IS_NULL(x) ((x).type == VAL_NULL)
-#define IS_NUM(x) ((x).type == VAL_NUM)
+#define IS_DOUBLE(x) ((x).type == VAL_DOUBLE)
+#define IS_INT(x) ((x).type == VAL_INT)
 #define IS_BOOL(x) ((x).type == VAL_BOOL)
 #define IS_OBJ(x) ((x).type == VAL_OBJ)
 
-#define IS_INT(x) (IS_NUM(x) && fabs(round(AS_NUM(x)) - AS_NUM(x)) <= 0.0000001)
-
 #define BOOL_VALUE(x) ((Value){VAL_BOOL, {.boolean = x}})
-#define NUM_VALUE(x) ((Value){VAL_NUM, {.number = x}})
+#define NUM_VALUE(x) ((Value){VAL_DOUBLE, {.number = x}})
+#define INT_VALUE(x) ((Value){VAL_INT, {.integer = x}})
 #define OBJ_VALUE(x) ((Value){VAL_OBJ, {.obj = x}})
 #define NULL_VALUE ((Value){VAL_NULL, {.number = 0}})
+#define UNDEFINED_VALUE ((Value){VAL_UNDEFINED, {.number = 0}})
+
+#define IS_UNDEFINED(x) ((x).type == VAL_UNDEFINED)
+
+#define INT_FITS(x) true
+
+#endif
+
+// Integers and doubles are both numbers. AS_NUM reads either as a double.
+#define IS_NUM(x) (IS_DOUBLE(x) || IS_INT(x))
+#define AS_NUM(x) valueToDouble(x)
+
+static inline double valueToDouble(Value value) {
+	return IS_INT(value) ? (double)AS_INT(value) : AS_DOUBLE(value);
+}
+
+// Integer results that don't fit the integer range become doubles.
+static inline Value intValue(int64_t x) {
+	return INT_FITS(x) ? INT_VALUE(x) : NUM_VALUE((double)x);
+}
+
+// Integer arithmetic. A result that overflows becomes a double instead.
+#if defined(__GNUC__)
+#define ADD_OVERFLOWS(a, b, r) __builtin_add_overflow(a, b, r)
+#define SUB_OVERFLOWS(a, b, r) __builtin_sub_overflow(a, b, r)
+#define MUL_OVERFLOWS(a, b, r) __builtin_mul_overflow(a, b, r)
+#else
+static inline bool addOverflows(int64_t a, int64_t b, int64_t *r) {
+	if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b))
+		return true;
+	*r = a + b;
+	return false;
+}
+static inline bool subOverflows(int64_t a, int64_t b, int64_t *r) {
+	if ((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b))
+		return true;
+	*r = a - b;
+	return false;
+}
+static inline bool mulOverflows(int64_t a, int64_t b, int64_t *r) {
+	if (a > 0 ? (b > 0 ? a > INT64_MAX / b : b < INT64_MIN / a)
+			  : (b > 0 ? a < INT64_MIN / b : a != 0 && b < INT64_MAX / a))
+		return true;
+	*r = a * b;
+	return false;
+}
+#define ADD_OVERFLOWS(a, b, r) addOverflows(a, b, r)
+#define SUB_OVERFLOWS(a, b, r) subOverflows(a, b, r)
+#define MUL_OVERFLOWS(a, b, r) mulOverflows(a, b, r)
+#endif
+
+static inline Value intAdd(int64_t a, int64_t b) {
+	int64_t r;
+	if (ADD_OVERFLOWS(a, b, &r))
+		return NUM_VALUE((double)a + (double)b);
+	return intValue(r);
+}
+
+static inline Value intSub(int64_t a, int64_t b) {
+	int64_t r;
+	if (SUB_OVERFLOWS(a, b, &r))
+		return NUM_VALUE((double)a - (double)b);
+	return intValue(r);
+}
+
+static inline Value intMul(int64_t a, int64_t b) {
+	int64_t r;
+	if (MUL_OVERFLOWS(a, b, &r))
+		return NUM_VALUE((double)a * (double)b);
+	return intValue(r);
+}
+
+// Integer value of v. Doubles holding a whole number are accepted too.
+static inline bool toInteger(Value v, int64_t *out) {
+	if (IS_INT(v)) {
+		*out = AS_INT(v);
+		return true;
+	}
+	if (IS_DOUBLE(v)) {
+		double d = AS_DOUBLE(v);
+		if (d == floor(d) && fabs(d) <= 9007199254740992.0) {
+			*out = (int64_t)d;
+			return true;
+		}
+	}
+	return false;
+}
+
+static inline Value intShiftLeft(int64_t a, int64_t n) {
+	if (a >= (INT64_MIN >> n) && a <= (INT64_MAX >> n))
+		return intValue((int64_t)((uint64_t)a << n));
+	return NUM_VALUE(ldexp((double)a, (int)n));
+}
+
+static inline bool isTruthy(Value v) {
+#ifdef NAN_BOXING
+	if (IS_DOUBLE(v))
+		return AS_DOUBLE(v) != 0;
+	return v != FALSE_VALUE && v != NULL_VALUE && v != INT_VALUE(0);
+#else
+	switch (v.type) {
+	case VAL_BOOL:
+		return AS_BOOL(v);
+	case VAL_DOUBLE:
+		return AS_DOUBLE(v) != 0;
+	case VAL_INT:
+		return AS_INT(v) != 0;
+	case VAL_NULL:
+	case VAL_UNDEFINED:
+		return false;
+	case VAL_OBJ:
+		return true;
+	}
+	return false;
+#endif
+}
 
 void initValueArray(ValueArray *array);
 void writeValueArray(ValueArray *array, Value value);
 void freeValueArray(ValueArray *array);
 void printValue(Value value);
 bool equal(Value a, Value b);
+bool identical(Value a, Value b);
+uint32_t hashValue(Value value);
 
 #endif
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "dbg.h"
 #include "mem.h"
 #include "object.h"
+#include <inttypes.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -15,10 +16,14 @@ VM vm;
 static void resetStack();
 static Value peek(int distance);
 static void runtimeError(const char *format, ...);
-static bool callValue(Value callee, int args);
+static bool callValue(Value callee, int args, bool tail);
 static void defineNative(const char *name, NativeFn function);
-static bool invokeFromClass(ObjClass *klass, ObjString *name, uint8_t args);
-static bool invoke(ObjString *name, uint8_t args);
+static bool invokeFromClass(ObjClass *klass, ObjString *name, uint8_t args,
+							InlineCache *cache, bool tail);
+static bool invoke(ObjString *name, uint8_t args, InlineCache *cache,
+				   bool tail);
+static bool call(ObjClosure *closure, int args, bool tail);
+static void flattenSlot(Value *slot);
 
 #ifdef DEBUG_EXPOSEGC
 static Value gcNative(int argCount, Value *args) {
@@ -35,15 +40,54 @@ static Value clockNative(int argCount, Value *args) {
 		runtimeError("Builtin clock() function takes no arguments.");
 		vm.nativeError = true;
 	}
-	return NUM_VALUE((double)clock());
+	return intValue((int64_t)clock());
 }
 
 static Value slenNative(int argCount, Value *args) {
-	if (argCount != 1 || !IS_STRING(*args)) {
+	if (argCount != 1 || !isText(*args)) {
 		runtimeError("Builtin slen function takes 1 string argument.");
 		vm.nativeError = true;
 	}
-	return NUM_VALUE((double)AS_STRING(*args)->length);
+	return INT_VALUE(textLength(*args));
+}
+
+static Value ordNative(int argCount, Value *args) {
+	if (argCount != 1 || !isText(*args) || textLength(*args) != 1) {
+		runtimeError("Builtin ord function takes 1 one character string.");
+		vm.nativeError = true;
+		return NULL_VALUE;
+	}
+	return INT_VALUE((uint8_t)AS_CSTRING(*args)[0]);
+}
+
+static Value chrNative(int argCount, Value *args) {
+	if (argCount != 1 || !IS_INT(*args) || AS_INT(*args) < 0 ||
+		AS_INT(*args) >= UINT8_COUNT) {
+		runtimeError("Builtin chr function takes 1 integer from 0 to 255.");
+		vm.nativeError = true;
+		return NULL_VALUE;
+	}
+	return OBJ_VALUE((Obj *)vm.byteStrings[AS_INT(*args)]);
+}
+
+// byte(s, i) is s[i] as a number, for walking a string without making a
+// string per character.
+static Value byteNative(int argCount, Value *args) {
+	if (argCount != 2 || !isText(args[0]) || !IS_INT(args[1])) {
+		runtimeError("Builtin byte function takes a string and an integer.");
+		vm.nativeError = true;
+		return NULL_VALUE;
+	}
+	flattenSlot(&args[0]);
+	ObjString *str = AS_STRING(args[0]);
+	int64_t index = AS_INT(args[1]);
+	if (index < 0 || index >= str->length) {
+		runtimeError("Byte index out of range. (%" PRId64 " / %d).", index,
+					 str->length);
+		vm.nativeError = true;
+		return NULL_VALUE;
+	}
+	return INT_VALUE((uint8_t)str->chars[index]);
 }
 
 static Value sqrtNative(int argCount, Value *args) {
@@ -60,56 +104,81 @@ static Value strNative(int argCount, Value *args) {
 		vm.nativeError = true;
 	}
 	ObjString *r;
-	switch (args->type) {
-	case VAL_BOOL: {
-		r = copyString(AS_BOOL(*args) ? "true" : "false",
+	if (IS_BOOL(*args)) {
+		r = makeString(AS_BOOL(*args) ? "true" : "false",
 					   AS_BOOL(*args) ? 4 : 5);
-		break;
-	}
-	case VAL_NULL: {
-		r = copyString("null", 4);
-		break;
-	}
-	case VAL_NUM: {
-		if (IS_INT(*args)) {
-			char otp[15];
-			int len = sprintf(otp, "%d", (int)round(AS_NUM(*args)));
-			r = copyString(otp, len);
-			break;
-		}
-		char otp[20];
-		int len = sprintf(otp, "%g", AS_NUM(*args));
-		r = copyString(otp, len);
-		break;
-	}
-	default: {
+	} else if (IS_NULL(*args)) {
+		r = makeString("null", 4);
+	} else if (IS_INT(*args)) {
+		char otp[24];
+		int len = sprintf(otp, "%" PRId64, AS_INT(*args));
+		r = makeString(otp, len);
+	} else if (IS_DOUBLE(*args)) {
+		char otp[24];
+		int len = sprintf(otp, "%g", AS_DOUBLE(*args));
+		r = makeString(otp, len);
+	} else {
 		runtimeError("Cannot stringify objects.");
 		vm.nativeError = true;
-		r = copyString("", 0);
-	}
+		r = makeString("", 0);
 	}
 	return OBJ_VALUE((Obj *)r);
 }
 
 void initVM() {
+	vm.frames = malloc(sizeof(Callframe) * FRAMES_INITIAL);
+	vm.frameCapacity = FRAMES_INITIAL;
+	vm.stack = malloc(sizeof(Value) * STACK_INITIAL);
+	vm.stackCapacity = STACK_INITIAL;
+	if (vm.frames == NULL || vm.stack == NULL)
+		exit(1);
 	resetStack();
 	vm.objects = NULL;
 	initTable(&vm.strings);
-	initTable(&vm.globals);
+	initTable(&vm.globalNames);
+	initValueArray(&vm.globalValues);
 
 	vm.greyStack = NULL;
 	vm.greyCount = 0;
 	vm.greyCapacity = 0;
 
+	vm.remembered = NULL;
+	vm.rememberedCount = 0;
+	vm.rememberedCapacity = 0;
+
 	vm.bytesAllocated = 0;
 	vm.nextGC = 1024 * 1024;
+	vm.youngBytes = 0;
+	vm.gcPhase = GC_IDLE;
+	vm.sweepCurrent = NULL;
+	vm.sweepPrevious = NULL;
+
+#ifdef DEBUG_GC_PAUSES
+	vm.gcPauses = 0;
+	vm.longestGCPause = 0;
+#endif
 
 	vm.nativeError = false;
 
+	for (int i = 0; i < UINT8_COUNT; i++)
+		vm.byteStrings[i] = NULL;
+	for (int i = 0; i < UINT8_COUNT; i++) {
+		char c = (char)i;
+		vm.byteStrings[i] = copyString(&c, 1);
+	}
+
+#ifdef DEBUG_CACHE_STATS
+	vm.cacheHits = 0;
+	vm.cacheMisses = 0;
+#endif
+
 	defineNative("clock", clockNative);
 	defineNative("slen", slenNative);
 	defineNative("str", strNative);
 	defineNative("sqrt", sqrtNative);
+	defineNative("ord", ordNative);
+	defineNative("chr", chrNative);
+	defineNative("byte", byteNative);
 #ifdef DEBUG_EXPOSEGC
 	defineNative("gc", gcNative);
 #endif
@@ -118,38 +187,30 @@ void initVM() {
 void freeVM() {
 	freeObjects();
 	freeTable(&vm.strings);
-	freeTable(&vm.globals);
+	freeTable(&vm.globalNames);
+	freeValueArray(&vm.globalValues);
 	free(vm.greyStack);
+	free(vm.remembered);
+#ifdef PARALLEL_MARK
+	freeMarkers();
+#endif
+	free(vm.frames);
+	free(vm.stack);
 }
 
-static bool isTruthy(Value v) {
-	switch (v.type) {
-	case VAL_BOOL:
-		return AS_BOOL(v);
-	case VAL_NUM:
-		return AS_NUM(v) != 0;
-	case VAL_NULL:
-		return false;
-	case VAL_OBJ:
-		return true;
-	}
-	return false;
-}
 
 static void concat() {
-	ObjString *str2 = AS_STRING(peek(0));
-	ObjString *str1 = AS_STRING(peek(1));
-
-	size_t len = str1->length + str2->length;
-	char *newStr = ALLOCATE(char, len + 1);
-
-	memcpy(newStr, str1->chars, str1->length);
-	memcpy(newStr + str1->length, str2->chars, str2->length + 1);
-
-	ObjString *new = takeString(newStr, len);
+	Value result = concatenate(peek(1), peek(0));
 	pop();
 	pop();
-	push(OBJ_VALUE((Obj *)new));
+	push(result);
+}
+
+// Replaces a rope on the stack with its string, for operations that need the
+// characters.
+static void flattenSlot(Value *slot) {
+	if (IS_ROPE(*slot))
+		*slot = OBJ_VALUE((Obj *)flattenRope(AS_ROPE(*slot)));
 }
 
 static ObjUpvalue *captureUpvalue(Value *local) {
@@ -179,6 +240,7 @@ static void closeUpvalues(Value *last) {
 		ObjUpvalue *upvalue = vm.openUpvalues;
 		upvalue->closed = *upvalue->location;
 		upvalue->location = &upvalue->closed;
+		writeBarrierValue(&upvalue->obj, upvalue->closed);
 		vm.openUpvalues = upvalue->next;
 	}
 }
@@ -187,30 +249,104 @@ static void declareMethod(ObjString *name) {
 	Value method = peek(0);
 	ObjClass *klass = AS_CLASS(peek(1));
 	tableSet(&klass->methods, name, method);
+	writeBarrier(&klass->obj, &name->obj);
+	writeBarrierValue(&klass->obj, method);
 	pop();
 }
-static bool bindMethod(ObjClass *klass, ObjString *name) {
+#ifdef DEBUG_CACHE_STATS
+#define CACHE_HIT() (vm.cacheHits++)
+#define CACHE_MISS() (vm.cacheMisses++)
+#else
+#define CACHE_HIT()
+#define CACHE_MISS()
+#endif
+
+static inline CacheEntry *cacheLookup(InlineCache *cache, ObjShape *shape) {
+	int count = cache->count < IC_ENTRIES ? cache->count : IC_ENTRIES;
+	for (int i = 0; i < count; i++) {
+		if (cache->entries[i].shape == shape)
+			return &cache->entries[i];
+	}
+	return NULL;
+}
+
+// Instances in dictionary mode have no shape and are never cached.
+static void cacheUpdate(InlineCache *cache, ObjShape *shape, int slot,
+						Value method, ObjShape *transition) {
+	if (shape == NULL)
+		return;
+	CacheEntry *entry = cacheLookup(cache, shape);
+	if (entry == NULL) {
+		if (cache->count >= IC_ENTRIES) {
+			cache->count = IC_ENTRIES + 1;
+			return;
+		}
+		entry = &cache->entries[cache->count++];
+		entry->shape = shape;
+	}
+	entry->slot = slot;
+	entry->method = method;
+	entry->transition = transition;
+	// Caches belong to the running function.
+	Obj *owner = &vm.frames[vm.frameCount - 1].closure->func->obj;
+	writeBarrier(owner, &shape->obj);
+	writeBarrierValue(owner, method);
+	writeBarrier(owner, (Obj *)transition);
+}
+
+static void cacheField(InlineCache *cache, ObjInstance *instance,
+					   ObjString *name) {
+	if (instance->shape != NULL)
+		cacheUpdate(cache, instance->shape,
+					shapeLookup(instance->shape, name), NULL_VALUE, NULL);
+}
+
+static bool bindMethod(ObjClass *klass, ObjString *name, InlineCache *cache) {
 	Value method;
 	if (!tableGet(&klass->methods, name, &method)) {
 		runtimeError("Undefined property: %s", name->chars);
 		return false;
 	}
+	cacheUpdate(cache, AS_INSTANCE(peek(0))->shape, -1, method, NULL);
 	ObjMethod *bound = newMethod(peek(0), AS_CLOSURE(method));
 	pop();
 	push(OBJ_VALUE((Obj *)bound));
 	return true;
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(Callframe *frame) {
+	printf("          ");
+	for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+		printf("[ ");
+		printValue(*slot);
+		printf(" ]");
+	}
+	puts("");
+
+	disassembleInstruction(
+		&frame->closure->func->chunk,
+		(int)(frame->ip - frame->closure->func->chunk.code));
+}
+#endif
+
 static InterpretResult run() {
 	Callframe *frame = &(vm.frames[vm.frameCount - 1]);
 
 #define READ_BYTE() (*frame->ip++)
 #define READ_CONSTANT()                                                        \
 	(frame->closure->func->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() (AS_STRING(READ_CONSTANT()))
 #define READ_SHORT()                                                           \
 	(frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define BINARY_OPERATOR(o, valueType)                                          \
+#define READ_LONG()                                                            \
+	(frame->ip += 3,                                                           \
+	 (frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1])
+#define READ_CONSTANT_LONG()                                                   \
+	(frame->closure->func->chunk.constants.values[READ_LONG()])
+#define READ_STRING() (AS_STRING(READ_CONSTANT_LONG()))
+#define READ_CACHE() (&frame->closure->func->chunk.caches[READ_SHORT()])
+#define QUICKEN(op) (frame->ip[-1] = (op))
+#define BINARY_OPERATOR(o, valueType, quickened)                               \
 	do {                                                                       \
 		if (!(IS_NUM(peek(0)) && IS_NUM(peek(1)))) {                           \
 			runtimeError("Operation not supported on those types");            \
@@ -219,26 +355,196 @@ static InterpretResult run() {
 		double b = AS_NUM(pop());                                              \
 		double a = AS_NUM(pop());                                              \
 		push(valueType(a o b));                                                \
+		QUICKEN(quickened);                                                    \
+	} while (false)
+// Integers stay integers, anything else involving a double is a double. Only
+// operands of one kind are quickened, mixed ones stay on the generic opcode.
+#define ARITH_OPERATOR(o, intResult, valueType, intQuickened, numQuickened)    \
+	do {                                                                       \
+		Value b = peek(0);                                                     \
+		Value a = peek(1);                                                     \
+		if (IS_INT(a) && IS_INT(b)) {                                          \
+			vm.stackTop[-2] = intResult;                                       \
+			QUICKEN(intQuickened);                                             \
+		} else if (IS_NUM(a) && IS_NUM(b)) {                                   \
+			vm.stackTop[-2] = valueType(AS_NUM(a) o AS_NUM(b));                \
+			if (IS_DOUBLE(a) && IS_DOUBLE(b))                                  \
+				QUICKEN(numQuickened);                                         \
+		} else {                                                               \
+			runtimeError("Operation not supported on those types");            \
+			return INTERPRET_RUNTIME_ERROR;                                    \
+		}                                                                      \
+		vm.stackTop--;                                                         \
+	} while (false)
+#define COMPARE_OPERATOR(o, intQuickened, numQuickened)                        \
+	ARITH_OPERATOR(o, BOOL_VALUE(AS_INT(a) o AS_INT(b)), BOOL_VALUE,          \
+				   intQuickened, numQuickened)
+#define INT_OPERATOR(o)                                                        \
+	do {                                                                       \
+		int64_t a, b;                                                          \
+		if (!toInteger(peek(1), &a) || !toInteger(peek(0), &b)) {              \
+			runtimeError("Operands must be integers.");                        \
+			return INTERPRET_RUNTIME_ERROR;                                    \
+		}                                                                      \
+		vm.stackTop[-2] = intValue(a o b);                                     \
+		vm.stackTop--;                                                         \
+	} while (false)
+// Guard miss in a quickened handler: put the generic opcode back and run it.
+#define DEOPTIMIZE(generic)                                                    \
+	QUICKEN(generic);                                                          \
+	frame->ip--;                                                               \
+	DISPATCH()
+#define NUM_OPERATOR(o, valueType, generic)                                    \
+	if (!(IS_DOUBLE(peek(0)) && IS_DOUBLE(peek(1)))) {                         \
+		DEOPTIMIZE(generic);                                                   \
+	}                                                                          \
+	vm.stackTop[-2] =                                                          \
+		valueType(AS_DOUBLE(vm.stackTop[-2]) o AS_DOUBLE(vm.stackTop[-1]));    \
+	vm.stackTop--
+#define INT_QUICKENED(result, generic)                                         \
+	if (!(IS_INT(peek(0)) && IS_INT(peek(1)))) {                               \
+		DEOPTIMIZE(generic);                                                   \
+	}                                                                          \
+	{                                                                          \
+		int64_t a = AS_INT(vm.stackTop[-2]);                                   \
+		int64_t b = AS_INT(vm.stackTop[-1]);                                   \
+		vm.stackTop[-2] = result;                                              \
+	}                                                                          \
+	vm.stackTop--
+
+// Comparison fused with the OP_JUMP_IF_FALSE and OP_POP around it. A false
+// result jumps past the OP_POP at the target.
+#define COMPARE_JUMP(o)                                                        \
+	do {                                                                       \
+		Value b = peek(0);                                                     \
+		Value a = peek(1);                                                     \
+		bool result;                                                           \
+		if (IS_INT(a) && IS_INT(b)) {                                          \
+			result = AS_INT(a) o AS_INT(b);                                    \
+		} else if (IS_NUM(a) && IS_NUM(b)) {                                   \
+			result = AS_NUM(a) o AS_NUM(b);                                    \
+		} else {                                                               \
+			runtimeError("Operation not supported on those types");            \
+			return INTERPRET_RUNTIME_ERROR;                                    \
+		}                                                                      \
+		vm.stackTop -= 2;                                                      \
+		uint16_t offset = READ_SHORT();                                        \
+		if (!result)                                                           \
+			frame->ip += offset;                                               \
 	} while (false)
 
-	while (true) {
-		uint8_t instruction = READ_BYTE();
 #ifdef DEBUG_TRACE_EXECUTION
-		printf("          ");
-		for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-			printf("[ ");
-			printValue(*slot);
-			printf(" ]");
-		}
-		puts("");
+#define TRACE_EXECUTION() traceExecution(frame)
+#else
+#define TRACE_EXECUTION()                                                      \
+	do {                                                                       \
+	} while (false)
+#endif
 
-		disassembleInstruction(
-			&frame->closure->func->chunk,
-			(int)(frame->ip - frame->closure->func->chunk.code));
+#ifdef THREADED_DISPATCH
+	// One indirect jump per handler instead of a single shared one at the top
+	// of the switch. The switch below is still the entry point. Opcodes
+	// listed after the range override its default on purpose.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+	static void *dispatchTable[UINT8_COUNT] = {
+		[0 ... UINT8_MAX] = &&op_unknown,
+		[OP_RETURN] = &&op_OP_RETURN,
+		[OP_CONSTANT] = &&op_OP_CONSTANT,
+		[OP_NEGATE] = &&op_OP_NEGATE,
+		[OP_ADD] = &&op_OP_ADD,
+		[OP_SUB] = &&op_OP_SUB,
+		[OP_MUL] = &&op_OP_MUL,
+		[OP_DIV] = &&op_OP_DIV,
+		[OP_NULL] = &&op_OP_NULL,
+		[OP_TRUE] = &&op_OP_TRUE,
+		[OP_FALSE] = &&op_OP_FALSE,
+		[OP_NOT] = &&op_OP_NOT,
+		[OP_EQUALS] = &&op_OP_EQUALS,
+		[OP_NOT_EQUALS] = &&op_OP_NOT_EQUALS,
+		[OP_GREATER] = &&op_OP_GREATER,
+		[OP_LESS] = &&op_OP_LESS,
+		[OP_GREATER_EQUAL] = &&op_OP_GREATER_EQUAL,
+		[OP_LESS_EQUAL] = &&op_OP_LESS_EQUAL,
+		[OP_FACTORIAL] = &&op_OP_FACTORIAL,
+		[OP_PRINT] = &&op_OP_PRINT,
+		[OP_POP] = &&op_OP_POP,
+		[OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+		[OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+		[OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+		[OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+		[OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+		[OP_POPN] = &&op_OP_POPN,
+		[OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+		[OP_JUMP] = &&op_OP_JUMP,
+		[OP_LOOP] = &&op_OP_LOOP,
+		[OP_MODULO] = &&op_OP_MODULO,
+		[OP_CALL] = &&op_OP_CALL,
+		[OP_CLOSURE] = &&op_OP_CLOSURE,
+		[OP_SET_UPV] = &&op_OP_SET_UPV,
+		[OP_GET_UPV] = &&op_OP_GET_UPV,
+		[OP_CLOSE_UPV] = &&op_OP_CLOSE_UPV,
+		[OP_MAP] = &&op_OP_MAP,
+		[OP_CLASS] = &&op_OP_CLASS,
+		[OP_GET_FIELD] = &&op_OP_GET_FIELD,
+		[OP_SET_FIELD] = &&op_OP_SET_FIELD,
+		[OP_METHOD] = &&op_OP_METHOD,
+		[OP_INVOKE] = &&op_OP_INVOKE,
+		[OP_ADD_NUM] = &&op_OP_ADD_NUM,
+		[OP_ADD_STR] = &&op_OP_ADD_STR,
+		[OP_SUB_NUM] = &&op_OP_SUB_NUM,
+		[OP_MUL_NUM] = &&op_OP_MUL_NUM,
+		[OP_DIV_NUM] = &&op_OP_DIV_NUM,
+		[OP_LESS_NUM] = &&op_OP_LESS_NUM,
+		[OP_LESS_EQUAL_NUM] = &&op_OP_LESS_EQUAL_NUM,
+		[OP_GREATER_NUM] = &&op_OP_GREATER_NUM,
+		[OP_GREATER_EQUAL_NUM] = &&op_OP_GREATER_EQUAL_NUM,
+		[OP_INT_DIV] = &&op_OP_INT_DIV,
+		[OP_BIT_AND] = &&op_OP_BIT_AND,
+		[OP_BIT_OR] = &&op_OP_BIT_OR,
+		[OP_BIT_XOR] = &&op_OP_BIT_XOR,
+		[OP_BIT_NOT] = &&op_OP_BIT_NOT,
+		[OP_SHIFT_LEFT] = &&op_OP_SHIFT_LEFT,
+		[OP_SHIFT_RIGHT] = &&op_OP_SHIFT_RIGHT,
+		[OP_CONSTANT_LONG] = &&op_OP_CONSTANT_LONG,
+		[OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+		[OP_TAIL_INVOKE] = &&op_OP_TAIL_INVOKE,
+		[OP_GET_LOCAL_LOCAL] = &&op_OP_GET_LOCAL_LOCAL,
+		[OP_ADD_LOCAL_CONST] = &&op_OP_ADD_LOCAL_CONST,
+		[OP_GET_THIS_FIELD] = &&op_OP_GET_THIS_FIELD,
+		[OP_LESS_JUMP_IF_FALSE] = &&op_OP_LESS_JUMP_IF_FALSE,
+		[OP_LESS_EQUAL_JUMP_IF_FALSE] = &&op_OP_LESS_EQUAL_JUMP_IF_FALSE,
+		[OP_GREATER_JUMP_IF_FALSE] = &&op_OP_GREATER_JUMP_IF_FALSE,
+		[OP_GREATER_EQUAL_JUMP_IF_FALSE] = &&op_OP_GREATER_EQUAL_JUMP_IF_FALSE,
+		[OP_POP_LOOP] = &&op_OP_POP_LOOP,
+		[OP_ADD_INT] = &&op_OP_ADD_INT,
+		[OP_SUB_INT] = &&op_OP_SUB_INT,
+		[OP_MUL_INT] = &&op_OP_MUL_INT,
+		[OP_LESS_INT] = &&op_OP_LESS_INT,
+		[OP_LESS_EQUAL_INT] = &&op_OP_LESS_EQUAL_INT,
+		[OP_GREATER_INT] = &&op_OP_GREATER_INT,
+		[OP_GREATER_EQUAL_INT] = &&op_OP_GREATER_EQUAL_INT,
+	};
+#pragma GCC diagnostic pop
+#define CASE(op)                                                               \
+	case op:                                                                   \
+	op_##op
+#define DISPATCH()                                                             \
+	do {                                                                       \
+		TRACE_EXECUTION();                                                     \
+		goto *dispatchTable[READ_BYTE()];                                      \
+	} while (false)
+#else
+#define CASE(op) case op
+#define DISPATCH() continue
 #endif
 
+	while (true) {
+		TRACE_EXECUTION();
+		uint8_t instruction = READ_BYTE();
+
 		switch (instruction) {
-		case OP_RETURN: {
+		CASE(OP_RETURN): {
 			Value result = pop();
 			closeUpvalues(frame->slots);
 			vm.frameCount--;
@@ -249,171 +555,188 @@ static InterpretResult run() {
 			vm.stackTop = frame->slots;
 			push(result);
 			frame = &vm.frames[vm.frameCount - 1];
-			break;
+			DISPATCH();
 		}
-		case OP_CONSTANT: {
+		CASE(OP_CONSTANT): {
 			Value constant = READ_CONSTANT();
 			push(constant);
-			break;
+			DISPATCH();
+		}
+		CASE(OP_CONSTANT_LONG): {
+			Value constant = READ_CONSTANT_LONG();
+			push(constant);
+			DISPATCH();
 		}
-		case OP_NEGATE: {
+		CASE(OP_NEGATE): {
+			if (IS_INT(peek(0))) {
+				push(intSub(0, AS_INT(pop())));
+				DISPATCH();
+			}
 			if (!IS_NUM(peek(0))) {
 				runtimeError("Operand must be a number.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			push(NUM_VALUE(-AS_NUM(pop())));
-			break;
+			DISPATCH();
 		}
-		case OP_ADD: {
-			if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+		CASE(OP_ADD): {
+			if (isText(peek(0)) && isText(peek(1))) {
 				concat();
+				QUICKEN(OP_ADD_STR);
 			} else {
-				BINARY_OPERATOR(+, NUM_VALUE);
+				ARITH_OPERATOR(+, intAdd(AS_INT(a), AS_INT(b)), NUM_VALUE,
+							   OP_ADD_INT, OP_ADD_NUM);
 			}
 
-			break;
+			DISPATCH();
 		}
-		case OP_SUB: {
-			BINARY_OPERATOR(-, NUM_VALUE);
-			break;
+		CASE(OP_SUB): {
+			ARITH_OPERATOR(-, intSub(AS_INT(a), AS_INT(b)), NUM_VALUE,
+						   OP_SUB_INT, OP_SUB_NUM);
+			DISPATCH();
 		}
-		case OP_MUL: {
-			BINARY_OPERATOR(*, NUM_VALUE);
-			break;
+		CASE(OP_MUL): {
+			ARITH_OPERATOR(*, intMul(AS_INT(a), AS_INT(b)), NUM_VALUE,
+						   OP_MUL_INT, OP_MUL_NUM);
+			DISPATCH();
 		}
-		case OP_DIV: {
-			BINARY_OPERATOR(/, NUM_VALUE);
-			break;
+		CASE(OP_DIV): {
+			BINARY_OPERATOR(/, NUM_VALUE, OP_DIV_NUM);
+			DISPATCH();
 		}
-		case OP_NULL: {
+		CASE(OP_NULL): {
 			push(NULL_VALUE);
-			break;
+			DISPATCH();
 		}
-		case OP_TRUE: {
+		CASE(OP_TRUE): {
 			push(BOOL_VALUE(true));
-			break;
+			DISPATCH();
 		}
-		case OP_FALSE: {
+		CASE(OP_FALSE): {
 			push(BOOL_VALUE(false));
-			break;
+			DISPATCH();
 		}
-		case OP_NOT: {
+		CASE(OP_NOT): {
 			push(BOOL_VALUE(!isTruthy(pop())));
-			break;
+			DISPATCH();
 		}
-		case OP_EQUALS: {
+		CASE(OP_EQUALS): {
+			flattenSlot(vm.stackTop - 1);
+			flattenSlot(vm.stackTop - 2);
 			push(BOOL_VALUE(equal(pop(), pop())));
-			break;
+			DISPATCH();
 		}
-		case OP_NOT_EQUALS: {
+		CASE(OP_NOT_EQUALS): {
+			flattenSlot(vm.stackTop - 1);
+			flattenSlot(vm.stackTop - 2);
 			push(BOOL_VALUE(!equal(pop(), pop())));
-			break;
+			DISPATCH();
 		}
-		case OP_GREATER: {
-			BINARY_OPERATOR(>, BOOL_VALUE);
-			break;
+		CASE(OP_GREATER): {
+			COMPARE_OPERATOR(>, OP_GREATER_INT, OP_GREATER_NUM);
+			DISPATCH();
 		}
-		case OP_LESS: {
-			BINARY_OPERATOR(<, BOOL_VALUE);
-			break;
+		CASE(OP_LESS): {
+			COMPARE_OPERATOR(<, OP_LESS_INT, OP_LESS_NUM);
+			DISPATCH();
 		}
-		case OP_GREATER_EQUAL: {
-			BINARY_OPERATOR(>=, BOOL_VALUE);
-			break;
+		CASE(OP_GREATER_EQUAL): {
+			COMPARE_OPERATOR(>=, OP_GREATER_EQUAL_INT, OP_GREATER_EQUAL_NUM);
+			DISPATCH();
 		}
-		case OP_LESS_EQUAL: {
-			BINARY_OPERATOR(<=, BOOL_VALUE);
-			break;
+		CASE(OP_LESS_EQUAL): {
+			COMPARE_OPERATOR(<=, OP_LESS_EQUAL_INT, OP_LESS_EQUAL_NUM);
+			DISPATCH();
 		}
-		case OP_FACTORIAL: {
-			Value v = peek(0);
-			if (IS_INT(v) && (round(AS_NUM(v)) >= 0)) {
-				double value = AS_NUM(pop());
-				int output = 1;
-				for (int i = 2; i <= value; i++) {
-					output *= i;
+		CASE(OP_FACTORIAL): {
+			int64_t value;
+			if (toInteger(peek(0), &value) && value >= 0) {
+				pop();
+				Value output = INT_VALUE(1);
+				for (int64_t i = 2; i <= value; i++) {
+					output = IS_INT(output) ? intMul(AS_INT(output), i)
+											: NUM_VALUE(AS_DOUBLE(output) * i);
 				}
-				push(NUM_VALUE((double)output));
+				push(output);
 			} else {
 				runtimeError("Factorial can only be used on positive integers");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			break;
+			DISPATCH();
 		}
-		case OP_PRINT: {
+		CASE(OP_PRINT): {
+			flattenSlot(vm.stackTop - 1);
 			printValue(pop());
 			puts("");
-			break;
+			DISPATCH();
 		}
-		case OP_POP: {
+		CASE(OP_POP): {
 			pop();
-			break;
+			DISPATCH();
 		}
-		case OP_DEFINE_GLOBAL: {
-			ObjString *name = READ_STRING();
-			tableSet(&vm.globals, name, peek(0));
-			pop();
-			break;
+		CASE(OP_DEFINE_GLOBAL): {
+			uint16_t slot = READ_SHORT();
+			vm.globalValues.values[slot] = pop();
+			DISPATCH();
 		}
-		case OP_GET_GLOBAL: {
-			ObjString *name = READ_STRING();
-			Value value;
-			if (!tableGet(&vm.globals, name, &value)) {
-				runtimeError("Variable %s not defined", name->chars);
+		CASE(OP_GET_GLOBAL): {
+			uint16_t slot = READ_SHORT();
+			Value value = vm.globalValues.values[slot];
+			if (IS_UNDEFINED(value)) {
+				runtimeError("Variable %s not defined",
+							 globalName(slot)->chars);
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			push(value);
-			break;
+			DISPATCH();
 		}
-		case OP_SET_GLOBAL: {
-			ObjString *name = READ_STRING();
-			Value set = peek(0);
-			if (tableSet(&vm.globals, name, set)) {
-				tableRemove(&vm.globals, name);
-				runtimeError("Variable %s not defined", name->chars);
+		CASE(OP_SET_GLOBAL): {
+			uint16_t slot = READ_SHORT();
+			if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+				runtimeError("Variable %s not defined",
+							 globalName(slot)->chars);
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			break;
+			vm.globalValues.values[slot] = peek(0);
+			DISPATCH();
 		}
-		case OP_SET_LOCAL: {
+		CASE(OP_SET_LOCAL): {
 			uint8_t level = READ_BYTE();
 			frame->slots[level] = peek(0);
-			break;
+			DISPATCH();
 		}
-		case OP_GET_LOCAL: {
+		CASE(OP_GET_LOCAL): {
 			uint8_t level = READ_BYTE();
 			push(frame->slots[level]);
-			break;
+			DISPATCH();
 		}
-		case OP_POPN: {
+		CASE(OP_POPN): {
 			uint8_t count = READ_BYTE();
 			vm.stackTop -= count;
-			break;
+			DISPATCH();
 		}
-		case OP_JUMP_IF_FALSE: {
+		CASE(OP_JUMP_IF_FALSE): {
 			uint16_t offset = READ_SHORT();
 			if (!isTruthy(peek(0)))
 				frame->ip += offset;
-			break;
+			DISPATCH();
 		}
-		case OP_JUMP: {
+		CASE(OP_JUMP): {
 			uint16_t offset = READ_SHORT();
 			frame->ip += offset;
-			break;
+			DISPATCH();
 		}
-		case OP_LOOP: {
+		CASE(OP_LOOP): {
 			uint16_t offset = READ_SHORT();
 			frame->ip -= offset;
-			break;
+			DISPATCH();
 		}
-		case OP_MODULO: {
-			Value a = peek(0);
-			Value b = peek(1);
-			if (IS_INT(a) && (round(AS_NUM(a)) >= 1)) {
-				if (IS_INT(b) && (round(AS_NUM(b)) >= 0)) {
-					int right = round(AS_NUM(pop()));
-					int left = round(AS_NUM(pop()));
-					push(NUM_VALUE((double)(left % right)));
+		CASE(OP_MODULO): {
+			int64_t right, left;
+			if (toInteger(peek(0), &right) && right >= 1) {
+				if (toInteger(peek(1), &left) && left >= 0) {
+					vm.stackTop -= 2;
+					push(intValue(left % right));
 				} else {
 					runtimeError("Modulo supported only on positive ints.");
 					return INTERPRET_RUNTIME_ERROR;
@@ -423,125 +746,427 @@ static InterpretResult run() {
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			break;
+			DISPATCH();
 		}
-		case OP_CALL: {
+		CASE(OP_CALL): {
 			int args = READ_BYTE();
-			if (!callValue(peek(args), args)) {
+			if (!callValue(peek(args), args, false)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			frame = &vm.frames[vm.frameCount - 1];
-			break;
+			DISPATCH();
 		}
-		case OP_CLOSURE: {
-			ObjFunction *func = AS_FUNCTION(READ_CONSTANT());
-			ObjClosure *closure = newClosure(func);
+		CASE(OP_TAIL_CALL): {
+			int args = READ_BYTE();
+			// The callee and arguments take over this frame's window and the
+			// callee returns straight to our caller.
+			closeUpvalues(frame->slots);
+			memmove(frame->slots, vm.stackTop - args - 1,
+					sizeof(Value) * (args + 1));
+			vm.stackTop = frame->slots + args + 1;
+			if (!callValue(peek(args), args, true)) {
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			frame = &vm.frames[vm.frameCount - 1];
+			DISPATCH();
+		}
+		CASE(OP_CLOSURE): {
+			ObjFunction *func = AS_FUNCTION(READ_CONSTANT_LONG());
+			// Values copied from our locals or from our own cells each get a
+			// cell in the new closure.
+			int cellCount = 0;
+			for (int i = 0; i < func->upvalueCount; i++) {
+				uint8_t kind = frame->ip[2 * i];
+				uint8_t index = frame->ip[2 * i + 1];
+				if (kind == CAPTURE_LOCAL_VALUE ||
+					(kind == CAPTURE_ENCLOSING &&
+					 isClosureCell(frame->closure,
+								   frame->closure->upvalues[index])))
+					cellCount++;
+			}
+			ObjClosure *closure = newClosure(func, cellCount);
 			push(OBJ_VALUE((Obj *)closure));
+			ObjUpvalue *cell = closure->cells;
 			for (int i = 0; i < closure->upvalueCount; i++) {
-				uint8_t isLocal = READ_BYTE();
+				uint8_t kind = READ_BYTE();
 				uint8_t index = READ_BYTE();
-				if (isLocal) {
+				if (kind == CAPTURE_LOCAL) {
+					// Capturing can collect and promote the closure.
 					closure->upvalues[i] = captureUpvalue(frame->slots + index);
-				} else {
-					closure->upvalues[i] = frame->closure->upvalues[index];
+					writeBarrier(&closure->obj, &closure->upvalues[i]->obj);
+					continue;
 				}
+				ObjUpvalue *upvalue = kind == CAPTURE_ENCLOSING
+										  ? frame->closure->upvalues[index]
+										  : NULL;
+				if (upvalue != NULL &&
+					!isClosureCell(frame->closure, upvalue)) {
+					closure->upvalues[i] = upvalue;
+					writeBarrier(&closure->obj, &upvalue->obj);
+					continue;
+				}
+				// The slot read here is already the new closure when a local
+				// function captures itself.
+				cell->closed = upvalue != NULL ? upvalue->closed
+											   : frame->slots[index];
+				writeBarrierValue(&closure->obj, cell->closed);
+				closure->upvalues[i] = cell++;
 			}
-			break;
+			DISPATCH();
 		}
-		case OP_SET_UPV: {
-			uint8_t slot = READ_BYTE();
-			*frame->closure->upvalues[slot]->location = peek(0);
-			break;
+		CASE(OP_SET_UPV): {
+			ObjUpvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+			*upvalue->location = peek(0);
+			if (upvalue->location == &upvalue->closed)
+				writeBarrierValue(&upvalue->obj, peek(0));
+			DISPATCH();
 		}
-		case OP_GET_UPV: {
+		CASE(OP_GET_UPV): {
 			uint8_t slot = READ_BYTE();
 			push(*frame->closure->upvalues[slot]->location);
-			break;
+			DISPATCH();
 		}
-		case OP_CLOSE_UPV:
+		CASE(OP_CLOSE_UPV):
 			closeUpvalues(vm.stackTop - 1);
 			pop();
-			break;
-		case OP_MAP: {
-			if (!(IS_INT(peek(0)) && round(AS_NUM(peek(0))) >= 0)) {
+			DISPATCH();
+		CASE(OP_MAP): {
+			int64_t index;
+			if (!(toInteger(peek(0), &index) && index >= 0)) {
 				runtimeError("Map index can only be positive integer.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			int index = (int)round(AS_NUM(pop()));
+			pop();
+			flattenSlot(vm.stackTop - 1);
 			if (!IS_STRING(peek(0))) {
 				runtimeError("Only strings are maps.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			ObjString *str = (ObjString *)AS_OBJ(pop());
 			if (index >= str->length) {
-				runtimeError("Map index is too large. (%d / %d).", index,
-							 str->length);
+				runtimeError("Map index is too large. (%" PRId64 " / %d).",
+							 index, str->length);
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			ObjString *nstr = copyString(str->chars + index, 1);
-			push(OBJ_VALUE((Obj *)nstr));
-			break;
+			push(OBJ_VALUE((Obj *)vm.byteStrings[(uint8_t)str->chars[index]]));
+			DISPATCH();
 		}
-		case OP_CLASS: {
+		CASE(OP_CLASS): {
 			push(OBJ_VALUE((Obj *)newClass(READ_STRING())));
-			break;
+			DISPATCH();
 		}
-		case OP_GET_FIELD: {
+		CASE(OP_GET_THIS_FIELD):
+			push(frame->slots[0]);
+			// Fall through, the operands are the same as OP_GET_FIELD's.
+		CASE(OP_GET_FIELD): {
 			if (!IS_INSTANCE(peek(0))) {
 				runtimeError("Only instances can have fields");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			ObjInstance *instance = AS_INSTANCE(peek(0));
-			Value field;
 			ObjString *name = READ_STRING();
-			if (tableGet(&instance->fields, name, &field)) {
+			InlineCache *cache = READ_CACHE();
+			CacheEntry *entry = cacheLookup(cache, instance->shape);
+			if (entry != NULL) {
+				CACHE_HIT();
+				if (entry->slot >= 0) {
+					vm.stackTop[-1] = instance->slots[entry->slot];
+				} else {
+					ObjMethod *bound =
+						newMethod(peek(0), AS_CLOSURE(entry->method));
+					vm.stackTop[-1] = OBJ_VALUE((Obj *)bound);
+				}
+				DISPATCH();
+			}
+			CACHE_MISS();
+
+			Value field;
+			if (getField(instance, name, &field)) {
+				cacheField(cache, instance, name);
 				pop();
 				push(field);
-				break;
-			} else if (bindMethod(instance->klass, name)) {
-				break;
+				DISPATCH();
+			} else if (bindMethod(instance->klass, name, cache)) {
+				DISPATCH();
 			} else {
 				runtimeError("Invalid field: '%s'.", name->chars);
 				return INTERPRET_RUNTIME_ERROR;
 			}
 		}
-		case OP_SET_FIELD: {
+		CASE(OP_SET_FIELD): {
 			if (!IS_INSTANCE(peek(1))) {
 				runtimeError("Only instances can have fields");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			ObjInstance *instance = AS_INSTANCE(peek(1));
 			ObjString *name = READ_STRING();
-
-			tableSet(&instance->fields, name, peek(0));
+			InlineCache *cache = READ_CACHE();
+			ObjShape *shape = instance->shape;
+			CacheEntry *entry = cacheLookup(cache, shape);
+			if (entry != NULL) {
+				CACHE_HIT();
+				if (entry->transition != NULL) {
+					ensureSlots(instance, entry->transition->fieldCount);
+					instance->shape = entry->transition;
+					writeBarrier(&instance->obj, &entry->transition->obj);
+				}
+				instance->slots[entry->slot] = peek(0);
+				writeBarrierValue(&instance->obj, peek(0));
+			} else {
+				CACHE_MISS();
+				setField(instance, name, peek(0));
+				if (instance->shape != NULL && instance->shape != shape) {
+					cacheUpdate(cache, shape, instance->shape->fieldCount - 1,
+								NULL_VALUE, instance->shape);
+				} else {
+					cacheField(cache, instance, name);
+				}
+			}
 			Value set = pop();
 			pop();
 			push(set);
-			break;
+			DISPATCH();
 		}
-		case OP_METHOD: {
+		CASE(OP_METHOD): {
 			declareMethod(READ_STRING());
-			break;
+			DISPATCH();
+		}
+		CASE(OP_TAIL_INVOKE): {
+			// Like OP_TAIL_CALL, the receiver and arguments take over this
+			// frame's window. The argument count follows the name.
+			int args = frame->ip[3];
+			closeUpvalues(frame->slots);
+			memmove(frame->slots, vm.stackTop - args - 1,
+					sizeof(Value) * (args + 1));
+			vm.stackTop = frame->slots + args + 1;
 		}
-		case OP_INVOKE: {
+			// Fall through, the operands are the same as OP_INVOKE's.
+		CASE(OP_INVOKE): {
+			bool tail = frame->ip[-1] == OP_TAIL_INVOKE;
 			ObjString *name = READ_STRING();
 			uint8_t args = READ_BYTE();
-			if (!invoke(name, args))
+			InlineCache *cache = READ_CACHE();
+			Value receiver = peek(args);
+			CacheEntry *entry;
+			if (IS_INSTANCE(receiver) &&
+				(entry = cacheLookup(cache, AS_INSTANCE(receiver)->shape)) !=
+					NULL) {
+				CACHE_HIT();
+				if (entry->slot >= 0) {
+					Value field = AS_INSTANCE(receiver)->slots[entry->slot];
+					vm.stackTop[-args - 1] = field;
+					if (!callValue(field, args, tail))
+						return INTERPRET_RUNTIME_ERROR;
+				} else if (!call(AS_CLOSURE(entry->method), args, tail)) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				frame = &vm.frames[vm.frameCount - 1];
+				DISPATCH();
+			}
+			CACHE_MISS();
+			if (!invoke(name, args, cache, tail))
 				return INTERPRET_RUNTIME_ERROR;
 
 			frame = &vm.frames[vm.frameCount - 1];
-			break;
+			DISPATCH();
+		}
+		CASE(OP_INT_DIV): {
+			int64_t a, b;
+			if (!toInteger(peek(1), &a) || !toInteger(peek(0), &b)) {
+				runtimeError("Operands must be integers.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			if (b == 0) {
+				runtimeError("Division by zero.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			vm.stackTop -= 2;
+			if (a == INT64_MIN && b == -1)
+				push(NUM_VALUE(-(double)a));
+			else
+				push(intValue(a / b));
+			DISPATCH();
+		}
+		CASE(OP_BIT_AND): {
+			INT_OPERATOR(&);
+			DISPATCH();
 		}
-		default: {
+		CASE(OP_BIT_OR): {
+			INT_OPERATOR(|);
+			DISPATCH();
+		}
+		CASE(OP_BIT_XOR): {
+			INT_OPERATOR(^);
+			DISPATCH();
+		}
+		CASE(OP_BIT_NOT): {
+			int64_t a;
+			if (!toInteger(peek(0), &a)) {
+				runtimeError("Operand must be an integer.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			vm.stackTop[-1] = intValue(~a);
+			DISPATCH();
+		}
+		CASE(OP_SHIFT_LEFT):
+		CASE(OP_SHIFT_RIGHT): {
+			int64_t a, b;
+			if (!toInteger(peek(1), &a) || !toInteger(peek(0), &b)) {
+				runtimeError("Operands must be integers.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			if (b < 0 || b > 63) {
+				runtimeError("Shift count must be between 0 and 63.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			vm.stackTop -= 2;
+			if (frame->ip[-1] == OP_SHIFT_RIGHT)
+				push(intValue(a >> b));
+			else
+				push(intShiftLeft(a, b));
+			DISPATCH();
+		}
+		CASE(OP_GET_LOCAL_LOCAL): {
+			push(frame->slots[READ_BYTE()]);
+			push(frame->slots[READ_BYTE()]);
+			DISPATCH();
+		}
+		CASE(OP_ADD_LOCAL_CONST): {
+			Value a = frame->slots[READ_BYTE()];
+			Value b = READ_CONSTANT();
+			if (IS_INT(a) && IS_INT(b)) {
+				push(intAdd(AS_INT(a), AS_INT(b)));
+			} else if (IS_NUM(a) && IS_NUM(b)) {
+				push(NUM_VALUE(AS_NUM(a) + AS_NUM(b)));
+			} else if (isText(a) && isText(b)) {
+				push(a);
+				push(b);
+				concat();
+			} else {
+				runtimeError("Operation not supported on those types");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			DISPATCH();
+		}
+		CASE(OP_LESS_JUMP_IF_FALSE): {
+			COMPARE_JUMP(<);
+			DISPATCH();
+		}
+		CASE(OP_LESS_EQUAL_JUMP_IF_FALSE): {
+			COMPARE_JUMP(<=);
+			DISPATCH();
+		}
+		CASE(OP_GREATER_JUMP_IF_FALSE): {
+			COMPARE_JUMP(>);
+			DISPATCH();
+		}
+		CASE(OP_GREATER_EQUAL_JUMP_IF_FALSE): {
+			COMPARE_JUMP(>=);
+			DISPATCH();
+		}
+		CASE(OP_POP_LOOP): {
+			pop();
+			uint16_t offset = READ_SHORT();
+			frame->ip -= offset;
+			DISPATCH();
+		}
+		CASE(OP_ADD_NUM): {
+			NUM_OPERATOR(+, NUM_VALUE, OP_ADD);
+			DISPATCH();
+		}
+		CASE(OP_ADD_STR): {
+			if (!(isText(peek(0)) && isText(peek(1)))) {
+				DEOPTIMIZE(OP_ADD);
+			}
+			concat();
+			DISPATCH();
+		}
+		CASE(OP_SUB_NUM): {
+			NUM_OPERATOR(-, NUM_VALUE, OP_SUB);
+			DISPATCH();
+		}
+		CASE(OP_MUL_NUM): {
+			NUM_OPERATOR(*, NUM_VALUE, OP_MUL);
+			DISPATCH();
+		}
+		CASE(OP_DIV_NUM): {
+			// Division always gives a double, so integers don't deoptimize it.
+			if (!(IS_NUM(peek(0)) && IS_NUM(peek(1)))) {
+				DEOPTIMIZE(OP_DIV);
+			}
+			vm.stackTop[-2] =
+				NUM_VALUE(AS_NUM(vm.stackTop[-2]) / AS_NUM(vm.stackTop[-1]));
+			vm.stackTop--;
+			DISPATCH();
+		}
+		CASE(OP_LESS_NUM): {
+			NUM_OPERATOR(<, BOOL_VALUE, OP_LESS);
+			DISPATCH();
+		}
+		CASE(OP_LESS_EQUAL_NUM): {
+			NUM_OPERATOR(<=, BOOL_VALUE, OP_LESS_EQUAL);
+			DISPATCH();
+		}
+		CASE(OP_GREATER_NUM): {
+			NUM_OPERATOR(>, BOOL_VALUE, OP_GREATER);
+			DISPATCH();
+		}
+		CASE(OP_GREATER_EQUAL_NUM): {
+			NUM_OPERATOR(>=, BOOL_VALUE, OP_GREATER_EQUAL);
+			DISPATCH();
+		}
+		CASE(OP_ADD_INT): {
+			INT_QUICKENED(intAdd(a, b), OP_ADD);
+			DISPATCH();
+		}
+		CASE(OP_SUB_INT): {
+			INT_QUICKENED(intSub(a, b), OP_SUB);
+			DISPATCH();
+		}
+		CASE(OP_MUL_INT): {
+			INT_QUICKENED(intMul(a, b), OP_MUL);
+			DISPATCH();
+		}
+		CASE(OP_LESS_INT): {
+			INT_QUICKENED(BOOL_VALUE(a < b), OP_LESS);
+			DISPATCH();
+		}
+		CASE(OP_LESS_EQUAL_INT): {
+			INT_QUICKENED(BOOL_VALUE(a <= b), OP_LESS_EQUAL);
+			DISPATCH();
+		}
+		CASE(OP_GREATER_INT): {
+			INT_QUICKENED(BOOL_VALUE(a > b), OP_GREATER);
+			DISPATCH();
+		}
+		CASE(OP_GREATER_EQUAL_INT): {
+			INT_QUICKENED(BOOL_VALUE(a >= b), OP_GREATER_EQUAL);
+			DISPATCH();
+		}
+		default:
+#ifdef THREADED_DISPATCH
+		op_unknown:
+#endif
+		{
 			runtimeError("Cringe unknown instruction");
 			return INTERPRET_RUNTIME_ERROR;
 		}
 		}
+	}
 #undef READ_CONSTANT
 #undef READ_BYTE
 #undef READ_STRING
 #undef READ_SHORT
-	}
+#undef READ_LONG
+#undef READ_CONSTANT_LONG
+#undef READ_CACHE
+#undef QUICKEN
+#undef BINARY_OPERATOR
+#undef DEOPTIMIZE
+#undef NUM_OPERATOR
+#undef TRACE_EXECUTION
+#undef CASE
+#undef DISPATCH
 }
 
 InterpretResult interpret(const char *src) {
@@ -564,10 +1189,10 @@ InterpretResult interpret(const char *src) {
 		return INTERPRET_COMPILE_ERROR;
 
 	push(OBJ_VALUE((Obj *)script));
-	ObjClosure *closure = newClosure(script);
+	ObjClosure *closure = newClosure(script, 0);
 	pop();
 	push(OBJ_VALUE((Obj *)closure));
-	callValue(OBJ_VALUE((Obj *)closure), 0);
+	callValue(OBJ_VALUE((Obj *)closure), 0, false);
 
 #ifdef DEBUG_CLOCKS
 	start = clock();
@@ -577,6 +1202,14 @@ InterpretResult interpret(const char *src) {
 	end = clock();
 	printf("\nRunning took %ld ms.\n", end - start);
 #endif
+#ifdef DEBUG_CACHE_STATS
+	printf("\nInline caches: %zu hits, %zu misses.\n", vm.cacheHits,
+		   vm.cacheMisses);
+#endif
+#ifdef DEBUG_GC_PAUSES
+	printf("\nGC: %zu pauses, longest %.3f ms.\n", vm.gcPauses,
+		   vm.longestGCPause * 1000.0 / CLOCKS_PER_SEC);
+#endif
 
 	return res;
 }
@@ -594,7 +1227,8 @@ static void runtimeError(const char *format, ...) {
 		ObjFunction *function = frame->closure->func;
 
 		size_t instruction = frame->ip - function->chunk.code - 1;
-		fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+		fprintf(stderr, "[line %d] in ",
+				getLine(&function->chunk, instruction));
 		if (function->name == NULL) {
 			fprintf(stderr, "<script>\n");
 		} else {
@@ -609,25 +1243,84 @@ static void runtimeError(const char *format, ...) {
 static void defineNative(const char *name, NativeFn function) {
 	push(OBJ_VALUE((Obj *)copyString(name, (int)strlen(name))));
 	push(OBJ_VALUE((Obj *)newNative(function)));
-	tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+	int slot = globalSlot(AS_STRING(vm.stack[0]));
+	vm.globalValues.values[slot] = vm.stack[1];
+	pop();
 	pop();
+}
+
+// Slot of a global variable, allocating an undefined one on first use.
+int globalSlot(ObjString *name) {
+	Value slot;
+	if (tableGet(&vm.globalNames, name, &slot))
+		return (int)AS_INT(slot);
+
+	push(OBJ_VALUE((Obj *)name));
+	writeValueArray(&vm.globalValues, UNDEFINED_VALUE);
+	tableSet(&vm.globalNames, name, INT_VALUE(vm.globalValues.count - 1));
 	pop();
+	return vm.globalValues.count - 1;
+}
+
+ObjString *globalName(int slot) {
+	for (int i = 0; i < vm.globalNames.capacity; i++) {
+		Entry *entry = &vm.globalNames.entries[i];
+		if (entry->key != NULL && AS_INT(entry->value) == slot)
+			return entry->key;
+	}
+	return NULL;
 }
 void push(Value val) { *(vm.stackTop++) = val; }
 Value pop() { return *(--vm.stackTop); }
 
 static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
-static bool call(ObjClosure *closure, int args) {
+// Moves the stack to a bigger block, pointing frames and open upvalues at
+// the new one.
+static void growStack(int needed) {
+	int capacity = vm.stackCapacity;
+	while (capacity < needed)
+		capacity *= 2;
+	Value *stack = malloc(sizeof(Value) * capacity);
+	if (stack == NULL)
+		exit(1);
+	memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+
+	for (int i = 0; i < vm.frameCount; i++)
+		vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+	for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+		 upvalue = upvalue->next)
+		upvalue->location = stack + (upvalue->location - vm.stack);
+	vm.stackTop = stack + (vm.stackTop - vm.stack);
+
+	free(vm.stack);
+	vm.stack = stack;
+	vm.stackCapacity = capacity;
+}
+
+// A tail call replaces the current frame instead of pushing a new one.
+static bool call(ObjClosure *closure, int args, bool tail) {
 	if (args != closure->func->arity) {
 		runtimeError("Expected %d arguments in function call, but got %d.",
 					 closure->func->arity, args);
 		return false;
 	}
-	if (vm.frameCount == FRAMES_MAX) {
-		runtimeError("Stack overflow.");
-		return false;
+	if (!tail && vm.frameCount == vm.frameCapacity) {
+		if (vm.frameCount == FRAMES_MAX) {
+			runtimeError("Stack overflow.");
+			return false;
+		}
+		vm.frameCapacity *= 2;
+		vm.frames = realloc(vm.frames, sizeof(Callframe) * vm.frameCapacity);
+		if (vm.frames == NULL)
+			exit(1);
 	}
-	Callframe *frame = &vm.frames[vm.frameCount++];
+	int needed = (int)(vm.stackTop - args - 1 - vm.stack) +
+				 closure->func->maxStack + STACK_RESERVE;
+	if (needed > vm.stackCapacity)
+		growStack(needed);
+
+	Callframe *frame =
+		tail ? &vm.frames[vm.frameCount - 1] : &vm.frames[vm.frameCount++];
 	frame->closure = closure;
 	frame->ip = closure->func->chunk.code;
 
@@ -635,11 +1328,13 @@ static bool call(ObjClosure *closure, int args) {
 	return true;
 }
 
-static bool callValue(Value callee, int args) {
+// Natives and classes without an initializer leave their result in place of
+// the callee, so a tail call to one also drops the current frame.
+static bool callValue(Value callee, int args, bool tail) {
 	if (IS_OBJ(callee)) {
 		switch (AS_OBJ(callee)->type) {
 		case OBJ_CLOSURE: {
-			return call(AS_CLOSURE(callee), args);
+			return call(AS_CLOSURE(callee), args, tail);
 		}
 		case OBJ_NATIVE: {
 			NativeFn native = AS_NATIVE(callee)->f;
@@ -648,6 +1343,8 @@ static bool callValue(Value callee, int args) {
 				return false;
 			vm.stackTop -= args + 1;
 			push(result);
+			if (tail)
+				vm.frameCount--;
 			return true;
 		}
 		case OBJ_CLASS: {
@@ -655,17 +1352,19 @@ static bool callValue(Value callee, int args) {
 			vm.stackTop[-args - 1] = OBJ_VALUE((Obj *)newInstance(klass));
 			Value constructor;
 			if (tableGet(&klass->methods, klass->name, &constructor)) {
-				return call(AS_CLOSURE(constructor), args);
+				return call(AS_CLOSURE(constructor), args, tail);
 			} else if (args != 0) {
 				runtimeError("Expected 0 arguments, received %d.", args);
 				return false;
 			}
+			if (tail)
+				vm.frameCount--;
 			return true;
 		}
 		case OBJ_METHOD: {
 			ObjMethod *method = AS_METHOD(callee);
 			vm.stackTop[-args - 1] = method->parent;
-			return call(method->closure, args);
+			return call(method->closure, args, tail);
 		}
 
 		default:
@@ -676,16 +1375,19 @@ static bool callValue(Value callee, int args) {
 	runtimeError("Only classes and functions are callable");
 	return false;
 }
-static bool invokeFromClass(ObjClass *klass, ObjString *name, uint8_t args) {
+static bool invokeFromClass(ObjClass *klass, ObjString *name, uint8_t args,
+							InlineCache *cache, bool tail) {
 	Value method;
 	if (!tableGet(&klass->methods, name, &method)) {
 		runtimeError("Undefined property: %s", name->chars);
 		return false;
 	}
-	return call(AS_CLOSURE(method), args);
+	cacheUpdate(cache, AS_INSTANCE(peek(args))->shape, -1, method, NULL);
+	return call(AS_CLOSURE(method), args, tail);
 }
 
-static bool invoke(ObjString *name, uint8_t args) {
+static bool invoke(ObjString *name, uint8_t args, InlineCache *cache,
+				   bool tail) {
 	Value receiver = peek(args);
 	if (!IS_INSTANCE(receiver)) {
 		runtimeError("Only instances can have methods.");
@@ -693,10 +1395,11 @@ static bool invoke(ObjString *name, uint8_t args) {
 	}
 	ObjInstance *instance = AS_INSTANCE(receiver);
 	Value field;
-	if (tableGet(&instance->fields, name, &field)) {
+	if (getField(instance, name, &field)) {
+		cacheField(cache, instance, name);
 		vm.stackTop[-args - 1] = field;
-		return callValue(field, args);
+		return callValue(field, args, tail);
 	}
 
-	return invokeFromClass(instance->klass, name, args);
-}
+	return invokeFromClass(instance->klass, name, args, cache, tail);
+}
\ No newline at end of file
@@ -7,8 +7,18 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 256
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#ifdef DEBUG_GC_PAUSES
+#include <time.h>
+#endif
+
+// The stack and frames start small and grow on demand, up to FRAMES_MAX
+// nested calls.
+#define FRAMES_MAX (1 << 18)
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL 256
+// Room above a function's maxStack for values pushed to keep objects alive
+// across allocations.
+#define STACK_RESERVE 8
 
 typedef struct {
 	ObjClosure *closure;
@@ -16,22 +26,51 @@ typedef struct {
 	Value *slots;
 } Callframe;
 
+typedef enum { GC_IDLE, GC_MARKING, GC_SWEEPING } GCPhase;
+
 typedef struct {
-	Callframe frames[FRAMES_MAX];
+	Callframe *frames;
 	int frameCount;
-	Value stack[STACK_MAX];
+	int frameCapacity;
+	Value *stack;
 	Value *stackTop;
+	int stackCapacity;
 	Obj *objects;
 	Table strings;
-	Table globals;
+	// Globals are resolved to slots in globalValues at compile time. The
+	// name -> slot table is only needed for that and for error messages.
+	Table globalNames;
+	ValueArray globalValues;
 	ObjUpvalue* openUpvalues;
+	// Every one byte string, so indexing and chr() never allocate.
+	ObjString *byteStrings[UINT8_COUNT];
 	bool nativeError;
 	Obj** greyStack;
 	int greyCapacity;
 	int greyCount;
+	// Old objects that may point at young ones, scanned by minor collections.
+	Obj **remembered;
+	int rememberedCapacity;
+	int rememberedCount;
 
 	size_t bytesAllocated;
 	size_t nextGC;
+	// Bytes allocated since the collector last did any work.
+	size_t youngBytes;
+	GCPhase gcPhase;
+	// Next object to sweep, and the last one kept.
+	Obj *sweepCurrent;
+	Obj *sweepPrevious;
+
+#ifdef DEBUG_GC_PAUSES
+	size_t gcPauses;
+	clock_t longestGCPause;
+#endif
+
+#ifdef DEBUG_CACHE_STATS
+	size_t cacheHits;
+	size_t cacheMisses;
+#endif
 } VM;
 
 extern VM vm;
@@ -47,6 +86,9 @@ void freeVM();
 
 InterpretResult interpret(const char *src);
 
+int globalSlot(ObjString *name);
+ObjString *globalName(int slot);
+
 void push(Value val);
 Value pop();
 